@@ -0,0 +1,764 @@
+#ifndef __CONCURRENT_KVFIFO_H__
+#define __CONCURRENT_KVFIFO_H__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A kvfifo that many threads may use at the same time, without a lock around
+// the whole queue. K needs std::hash<K> and operator==.
+//
+// The elements form a singly linked list with a dummy node in front, as in
+// the two-lock queue of Michael and Scott: pushes link at the back under one
+// mutex, pops unlink at the front under another. The lists of elements with
+// the same key live in stripes chosen by the hash of the key, each with a
+// mutex of its own, so keyed operations on different stripes do not wait for
+// each other.
+//
+// pop(k) and move_to_back(k) cannot unlink an element from the middle of the
+// list, which the front mutex owns. They mark it removed instead; a pop skips
+// and frees the removed elements it meets at the front. move_to_back relinks
+// the values in new nodes at the back. Once the removed nodes outnumber the
+// elements, the keyed operation that removed the last of them unlocks its
+// stripe, locks the front and the back and unlinks them all, so there are
+// never many more nodes than twice the elements, however long the front
+// element stays put.
+//
+// Since another thread may pop an element at any time, front, first and last
+// return copies, and pop returns the element it removed. If an operation
+// throws, the queue is unchanged.
+//
+// pop_wait and pop_wait_for sleep on a condition variable of the front mutex
+// until there is an element, pop_wait(k) on one of the stripe of k until
+// there is an element with the key. A push wakes them only if some thread
+// waits, which it can tell without taking the front mutex.
+//
+// co_await async_pop(executor) and async_pop(k, executor) suspend the
+// coroutine instead, in a list of waiters at the front or in the stripe of k.
+// A push that finds a waiter pops an element for it and posts the coroutine
+// to its executor, which resumes it with the element. A push of k hands the
+// element straight to a coroutine waiting for k: there is no element with the
+// key in the queue that it could overtake. If popping for the coroutine
+// throws, the element stays in the queue and the co_await rethrows the
+// exception when the coroutine resumes. The element is out of the queue
+// by the time the coroutine is posted, so post must be noexcept. A waiting
+// coroutine must not be destroyed, nor the queue while a coroutine waits on
+// it.
+//
+// Locks are taken in the order front, stripe, back, and never two stripes.
+template <typename K, typename V>
+class concurrent_kvfifo {
+private:
+    struct kv_link {
+        std::atomic<kv_link *> next{nullptr};
+        std::atomic<bool> removed{false};
+    };
+
+    // The value goes away when the element is removed, the node once the
+    // front passes it.
+    struct kv_node : kv_link {
+        K const key;
+        std::optional<V> value;
+        // Next element with the key, guarded by the stripe of the key.
+        kv_node *next_same = nullptr;
+
+        template <typename Key, typename... Args>
+        explicit kv_node(Key &&k, Args &&...args)
+            : key(std::forward<Key>(k)),
+              value(std::in_place, std::forward<Args>(args)...) {}
+    };
+
+    // Elements with the same key, in queue order.
+    struct kv_chain {
+        size_t count = 0;
+        kv_node *head = nullptr;
+        kv_node *tail = nullptr;
+    };
+
+    // A coroutine in async_pop, waiting for an element of key, or for any
+    // element if it has none. schedule posts it to its executor; the waiter
+    // may be gone as soon as it is called.
+    struct kv_async_waiter {
+        std::optional<K> key;
+        std::coroutine_handle<> handle;
+        void (*schedule)(kv_async_waiter *) noexcept;
+        std::optional<std::pair<K, V>> element = std::nullopt;
+        // Thrown by the pop made for the coroutine, instead of an element.
+        std::exception_ptr error = nullptr;
+        kv_async_waiter *next = nullptr;
+    };
+
+    struct alignas(64) kv_stripe {
+        std::mutex lock;
+        std::unordered_map<K, kv_chain> chains;
+        // Threads in pop_wait(k) for a key of the stripe.
+        std::condition_variable available;
+        size_t waiters = 0;
+        // Coroutines in async_pop(k) for a key of the stripe, oldest first.
+        kv_async_waiter *async_waiters = nullptr;
+    };
+
+    static constexpr size_t stripe_count = 64;
+    // Removed nodes allowed beyond one per element before they are reclaimed.
+    static constexpr size_t reclaim_slack = 64;
+
+    alignas(64) std::mutex front_lock;
+    kv_link *head;
+    // Threads in pop_wait or pop_wait_for.
+    std::condition_variable nonempty;
+    // Coroutines in async_pop, oldest first.
+    kv_async_waiter *async_head;
+    kv_async_waiter *async_tail;
+    // Threads and coroutines waiting for any element.
+    std::atomic<size_t> front_waiters;
+    alignas(64) std::mutex back_lock;
+    kv_link *tail;
+    std::atomic<size_t> elements;
+    // Nodes marked removed and not freed yet.
+    std::atomic<size_t> removed_links;
+    kv_link sentinel;
+    std::array<kv_stripe, stripe_count> stripes;
+
+    kv_stripe &stripe(K const &k);
+    kv_node *front_node(std::unique_lock<std::mutex> &stripe_lock);
+    void free_removed_front() noexcept;
+    void reclaim_removed() noexcept;
+    void link_back(kv_node *first, kv_node *last) noexcept;
+    void free_link(kv_link *link) noexcept;
+
+    template <typename Key, typename... Args>
+    void emplace_key(Key &&k, Args &&...args);
+    std::pair<K, V> remove_first(kv_chain &chain);
+    std::pair<K, V> remove_front(kv_node *node,
+                                 std::unique_lock<std::mutex> &stripe_lock);
+
+    template <typename Wait>
+    std::optional<std::pair<K, V>> pop_when(Wait wait);
+
+    kv_async_waiter **find_async_waiter(kv_stripe &s, K const &k);
+    void wake_front_waiter();
+    bool suspend_front(kv_async_waiter &waiter);
+    bool suspend_key(kv_async_waiter &waiter);
+
+public:
+    // What co_await async_pop waits on. It holds its own copy of the key,
+    // and the element from the time a push hands it over until the coroutine
+    // resumes.
+    template <typename Executor>
+    class pop_awaiter : private kv_async_waiter {
+        static_assert(noexcept(std::declval<Executor &>().post(
+                              std::declval<std::coroutine_handle<>>())),
+                      "async_pop needs an executor whose post is noexcept");
+
+    public:
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            this->handle = h;
+            return this->key ? queue.suspend_key(*this)
+                             : queue.suspend_front(*this);
+        }
+
+        std::pair<K, V> await_resume() {
+            if (this->error) {
+                std::rethrow_exception(this->error);
+            }
+            return std::move(*this->element);
+        }
+
+    private:
+        friend class concurrent_kvfifo;
+
+        concurrent_kvfifo &queue;
+        Executor &executor;
+
+        pop_awaiter(concurrent_kvfifo &q, std::optional<K> k, Executor &ex)
+            : kv_async_waiter{std::move(k), nullptr, &schedule_on_executor},
+              queue(q),
+              executor(ex) {}
+
+        static void schedule_on_executor(kv_async_waiter *waiter) noexcept {
+            auto *self = static_cast<pop_awaiter *>(waiter);
+            self->executor.post(self->handle);
+        }
+    };
+
+    concurrent_kvfifo();
+    concurrent_kvfifo(concurrent_kvfifo const &) = delete;
+    concurrent_kvfifo& operator=(concurrent_kvfifo const &) = delete;
+    ~concurrent_kvfifo() noexcept;
+
+    void push(K const &k, V const &v);
+    void push(K const &k, V &&v);
+    void push(K &&k, V const &v);
+    void push(K &&k, V &&v);
+
+    template <typename... Args>
+    void emplace(K const &k, Args &&...args);
+    template <typename... Args>
+    void emplace(K &&k, Args &&...args);
+
+    std::pair<K, V> pop();
+    std::pair<K, V> pop(K const &k);
+
+    // As pop, but they wait for an element instead of throwing.
+    // pop_wait_for gives up after the timeout and returns nothing.
+    std::pair<K, V> pop_wait();
+    template <typename Rep, typename Period>
+    std::optional<std::pair<K, V>> pop_wait_for(
+            std::chrono::duration<Rep, Period> const &timeout);
+    std::pair<K, V> pop_wait(K const &k);
+
+    // co_await on them pops an element, suspending the coroutine while there
+    // is none. The coroutine resumes on the executor, with
+    // executor.post(handle), which must be noexcept, if it had to wait, and
+    // right away otherwise. The key is copied, so it need not outlive the
+    // co_await.
+    template <typename Executor>
+    pop_awaiter<Executor> async_pop(Executor &executor);
+    template <typename Executor>
+    pop_awaiter<Executor> async_pop(K const &k, Executor &executor);
+
+    void move_to_back(K const &k);
+
+    std::pair<K, V> front();
+    std::pair<K, V> first(K const &key);
+    std::pair<K, V> last(K const &key);
+
+    size_t size() const noexcept;
+    size_t count(K const &k);
+    bool empty() const noexcept;
+};
+
+template <typename K, typename V>
+concurrent_kvfifo<K, V>::concurrent_kvfifo()
+    : head(&sentinel),
+      async_head(nullptr),
+      async_tail(nullptr),
+      front_waiters(0),
+      tail(&sentinel),
+      elements(0),
+      removed_links(0) {}
+
+template <typename K, typename V>
+concurrent_kvfifo<K, V>::~concurrent_kvfifo() noexcept {
+    while (head != nullptr) {
+        kv_link *next = head->next.load(std::memory_order_relaxed);
+        free_link(head);
+        head = next;
+    }
+}
+
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::free_link(kv_link *link) noexcept {
+    if (link != &sentinel) {
+        delete static_cast<kv_node *>(link);
+    }
+}
+
+template <typename K, typename V>
+typename concurrent_kvfifo<K, V>::kv_stripe &
+concurrent_kvfifo<K, V>::stripe(K const &k) {
+    return stripes[std::hash<K>()(k) % stripe_count];
+}
+
+// Links the chain first..last at the back. Its last node already ends it.
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::link_back(kv_node *first,
+                                        kv_node *last) noexcept {
+    std::lock_guard<std::mutex> guard(back_lock);
+    tail->next.store(first, std::memory_order_release);
+    tail = last;
+}
+
+// Called with the front locked. The node after head becomes the new dummy,
+// and the old one is freed: nothing but the front looks at it any more.
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::free_removed_front() noexcept {
+    kv_link *next = head->next.load(std::memory_order_acquire);
+    while (next != nullptr && next->removed.load(std::memory_order_acquire)) {
+        if (head != &sentinel) {
+            removed_links.fetch_sub(1, std::memory_order_relaxed);
+        }
+        free_link(std::exchange(head, next));
+        next = head->next.load(std::memory_order_acquire);
+    }
+}
+
+// Called with no lock taken, after a keyed operation marked nodes removed.
+// Unlinks and frees every removed node but the dummy and the tail if there
+// are more of them than elements. Only the front and the back look at the
+// links, so with both mutexes locked nothing else sees them change; the
+// stripes only set removed, and leave a node alone once they did.
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::reclaim_removed() noexcept {
+    auto too_many = [this] {
+        return removed_links.load(std::memory_order_relaxed)
+               > elements.load(std::memory_order_relaxed) + reclaim_slack;
+    };
+    if (!too_many()) {
+        return;
+    }
+    std::lock_guard<std::mutex> front_guard(front_lock);
+    if (!too_many()) {
+        return;
+    }
+    std::lock_guard<std::mutex> back_guard(back_lock);
+    free_removed_front();
+    kv_link *previous = head;
+    kv_link *link = previous->next.load(std::memory_order_relaxed);
+    while (link != nullptr) {
+        kv_link *next = link->next.load(std::memory_order_relaxed);
+        if (link != tail && link->removed.load(std::memory_order_acquire)) {
+            previous->next.store(next, std::memory_order_relaxed);
+            removed_links.fetch_sub(1, std::memory_order_relaxed);
+            free_link(link);
+        } else {
+            previous = link;
+        }
+        link = next;
+    }
+}
+
+// Called with the front locked. Returns the first element, with its stripe
+// locked in stripe_lock, or null if the queue is empty.
+template <typename K, typename V>
+typename concurrent_kvfifo<K, V>::kv_node *
+concurrent_kvfifo<K, V>::front_node(std::unique_lock<std::mutex> &stripe_lock) {
+    while (true) {
+        free_removed_front();
+        auto *node = static_cast<kv_node *>(
+                head->next.load(std::memory_order_acquire));
+        if (node == nullptr) {
+            return nullptr;
+        }
+        stripe_lock = std::unique_lock<std::mutex>(stripe(node->key).lock);
+        // Removed by pop(k) or move_to_back while the stripe was not locked.
+        if (!node->removed.load(std::memory_order_relaxed)) {
+            return node;
+        }
+        stripe_lock.unlock();
+    }
+}
+
+// Called with the stripe of the chain locked. Every element before the first
+// of a key is removed, so the front may free its node from now on.
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::remove_first(
+        kv_chain &chain) {
+    kv_node *node = chain.head;
+    std::pair<K, V> element(node->key, std::move(*node->value));
+    chain.head = node->next_same;
+    if (chain.head == nullptr) {
+        chain.tail = nullptr;
+    }
+    --chain.count;
+    node->value.reset();
+    removed_links.fetch_add(1, std::memory_order_relaxed);
+    node->removed.store(true, std::memory_order_release);
+    elements.fetch_sub(1, std::memory_order_relaxed);
+    return element;
+}
+
+// The node is made before any lock is taken. The stripe stays locked until
+// the node is linked, so the elements of a key are linked in chain order.
+//
+// A coroutine waiting for the key gets the element without it ever being
+// linked.
+//
+// A waiter in pop_wait counts itself in front_waiters before it looks at the
+// front, and the push links its node before it reads front_waiters. Both
+// read-modify-write front_waiters, so one comes first: either the waiter then
+// sees the node, or the push sees the waiter and takes the front mutex, which
+// the waiter holds until it sleeps.
+template <typename K, typename V>
+template <typename Key, typename... Args>
+void concurrent_kvfifo<K, V>::emplace_key(Key &&k, Args &&...args) {
+    auto node = std::make_unique<kv_node>(std::forward<Key>(k),
+                                          std::forward<Args>(args)...);
+    kv_stripe &s = stripe(node->key);
+    {
+        std::unique_lock<std::mutex> guard(s.lock);
+        kv_async_waiter **link = s.async_waiters != nullptr
+                                 ? find_async_waiter(s, node->key) : nullptr;
+        if (link != nullptr) {
+            (*link)->element.emplace(node->key, std::move(*node->value));
+            kv_async_waiter *waiter = std::exchange(*link, (*link)->next);
+            guard.unlock();
+            waiter->schedule(waiter);
+            return;
+        }
+        kv_chain &chain = s.chains[node->key];
+        kv_node *linked = node.release();
+        (chain.tail != nullptr ? chain.tail->next_same : chain.head) = linked;
+        chain.tail = linked;
+        ++chain.count;
+        elements.fetch_add(1, std::memory_order_relaxed);
+        link_back(linked, linked);
+        if (s.waiters > 0) {
+            s.available.notify_all();
+        }
+    }
+    if (front_waiters.fetch_add(0, std::memory_order_acq_rel) > 0) {
+        wake_front_waiter();
+    }
+}
+
+// Called with the stripe locked. Returns the link to the oldest coroutine
+// waiting for k, or null if there is none.
+template <typename K, typename V>
+typename concurrent_kvfifo<K, V>::kv_async_waiter **
+concurrent_kvfifo<K, V>::find_async_waiter(kv_stripe &s, K const &k) {
+    for (kv_async_waiter **link = &s.async_waiters; *link != nullptr;
+         link = &(*link)->next) {
+        if (*(*link)->key == k) {
+            return link;
+        }
+    }
+    return nullptr;
+}
+
+// Called after a push, with no lock taken. Coroutines go before threads. If
+// popping for a coroutine throws, the element stays in the queue, the
+// coroutine resumes with the exception, and the push that made it still
+// succeeds.
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::wake_front_waiter() {
+    std::unique_lock<std::mutex> guard(front_lock);
+    if (async_head == nullptr) {
+        nonempty.notify_one();
+        return;
+    }
+    std::unique_lock<std::mutex> stripe_lock;
+    kv_node *node = front_node(stripe_lock);
+    if (node == nullptr) {
+        return;
+    }
+    kv_async_waiter *waiter = async_head;
+    try {
+        waiter->element.emplace(remove_front(node, stripe_lock));
+    } catch (...) {
+        if (stripe_lock.owns_lock()) {
+            stripe_lock.unlock();
+        }
+        waiter->error = std::current_exception();
+    }
+    async_head = waiter->next;
+    if (async_head == nullptr) {
+        async_tail = nullptr;
+    }
+    front_waiters.fetch_sub(1, std::memory_order_relaxed);
+    guard.unlock();
+    waiter->schedule(waiter);
+}
+
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::push(K const &k, V const &v) {
+    emplace_key(k, v);
+}
+
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::push(K const &k, V &&v) {
+    emplace_key(k, std::move(v));
+}
+
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::push(K &&k, V const &v) {
+    emplace_key(std::move(k), v);
+}
+
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::push(K &&k, V &&v) {
+    emplace_key(std::move(k), std::move(v));
+}
+
+template <typename K, typename V>
+template <typename... Args>
+void concurrent_kvfifo<K, V>::emplace(K const &k, Args &&...args) {
+    emplace_key(k, std::forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+template <typename... Args>
+void concurrent_kvfifo<K, V>::emplace(K &&k, Args &&...args) {
+    emplace_key(std::move(k), std::forward<Args>(args)...);
+}
+
+// Called with the front locked, on the node front_node returned.
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::remove_front(
+        kv_node *node, std::unique_lock<std::mutex> &stripe_lock) {
+    auto &chains = stripe(node->key).chains;
+    auto it = chains.find(node->key);
+    auto element = remove_first(it->second);
+    if (it->second.count == 0) {
+        chains.erase(it);
+    }
+    stripe_lock.unlock();
+    free_removed_front();
+    return element;
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::pop() {
+    std::lock_guard<std::mutex> guard(front_lock);
+    std::unique_lock<std::mutex> stripe_lock;
+    kv_node *node = front_node(stripe_lock);
+    if (node == nullptr) {
+        throw std::invalid_argument("Queue is empty!");
+    }
+    return remove_front(node, stripe_lock);
+}
+
+// Pops the first element, calling wait with the front locked whenever the
+// queue is empty. Once wait returns false, looks one last time and returns
+// nothing if the queue is still empty.
+template <typename K, typename V>
+template <typename Wait>
+std::optional<std::pair<K, V>> concurrent_kvfifo<K, V>::pop_when(Wait wait) {
+    std::unique_lock<std::mutex> guard(front_lock);
+    std::unique_lock<std::mutex> stripe_lock;
+    front_waiters.fetch_add(1, std::memory_order_acq_rel);
+    kv_node *node = front_node(stripe_lock);
+    for (bool waiting = true; node == nullptr && waiting;) {
+        waiting = wait(guard);
+        node = front_node(stripe_lock);
+    }
+    front_waiters.fetch_sub(1, std::memory_order_relaxed);
+    if (node == nullptr) {
+        return std::nullopt;
+    }
+    return remove_front(node, stripe_lock);
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::pop_wait() {
+    return *pop_when([this](std::unique_lock<std::mutex> &guard) {
+        nonempty.wait(guard);
+        return true;
+    });
+}
+
+template <typename K, typename V>
+template <typename Rep, typename Period>
+std::optional<std::pair<K, V>> concurrent_kvfifo<K, V>::pop_wait_for(
+        std::chrono::duration<Rep, Period> const &timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    return pop_when([this, deadline](std::unique_lock<std::mutex> &guard) {
+        return nonempty.wait_until(guard, deadline)
+               == std::cv_status::no_timeout;
+    });
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::pop(K const &k) {
+    kv_stripe &s = stripe(k);
+    std::unique_lock<std::mutex> guard(s.lock);
+    auto it = s.chains.find(k);
+    if (it == s.chains.end()) {
+        throw std::invalid_argument("No such key in the queue!");
+    }
+    auto element = remove_first(it->second);
+    if (it->second.count == 0) {
+        s.chains.erase(it);
+    }
+    guard.unlock();
+    reclaim_removed();
+    return element;
+}
+
+// Returns false, with the element in the waiter, if there is one to pop
+// already; otherwise queues the waiter for a push to wake.
+template <typename K, typename V>
+bool concurrent_kvfifo<K, V>::suspend_front(kv_async_waiter &waiter) {
+    std::lock_guard<std::mutex> guard(front_lock);
+    std::unique_lock<std::mutex> stripe_lock;
+    front_waiters.fetch_add(1, std::memory_order_acq_rel);
+    if (kv_node *node = front_node(stripe_lock)) {
+        front_waiters.fetch_sub(1, std::memory_order_relaxed);
+        waiter.element.emplace(remove_front(node, stripe_lock));
+        return false;
+    }
+    (async_tail != nullptr ? async_tail->next : async_head) = &waiter;
+    async_tail = &waiter;
+    return true;
+}
+
+template <typename K, typename V>
+bool concurrent_kvfifo<K, V>::suspend_key(kv_async_waiter &waiter) {
+    kv_stripe &s = stripe(*waiter.key);
+    std::unique_lock<std::mutex> guard(s.lock);
+    auto it = s.chains.find(*waiter.key);
+    if (it != s.chains.end()) {
+        waiter.element.emplace(remove_first(it->second));
+        if (it->second.count == 0) {
+            s.chains.erase(it);
+        }
+        guard.unlock();
+        reclaim_removed();
+        return false;
+    }
+    kv_async_waiter **end = &s.async_waiters;
+    while (*end != nullptr) {
+        end = &(*end)->next;
+    }
+    *end = &waiter;
+    return true;
+}
+
+template <typename K, typename V>
+template <typename Executor>
+typename concurrent_kvfifo<K, V>::template pop_awaiter<Executor>
+concurrent_kvfifo<K, V>::async_pop(Executor &executor) {
+    return pop_awaiter<Executor>(*this, std::nullopt, executor);
+}
+
+template <typename K, typename V>
+template <typename Executor>
+typename concurrent_kvfifo<K, V>::template pop_awaiter<Executor>
+concurrent_kvfifo<K, V>::async_pop(K const &k, Executor &executor) {
+    return pop_awaiter<Executor>(*this, k, executor);
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::pop_wait(K const &k) {
+    kv_stripe &s = stripe(k);
+    std::unique_lock<std::mutex> guard(s.lock);
+    auto it = s.chains.find(k);
+    while (it == s.chains.end()) {
+        ++s.waiters;
+        s.available.wait(guard);
+        --s.waiters;
+        it = s.chains.find(k);
+    }
+    auto element = remove_first(it->second);
+    if (it->second.count == 0) {
+        s.chains.erase(it);
+    }
+    guard.unlock();
+    reclaim_removed();
+    return element;
+}
+
+// The values move to new nodes linked at the back in one go, and the old
+// nodes are removed after that, so that a pop never finds the queue empty in
+// between. V is copied if its move constructor may throw, and moved back if
+// making a node throws.
+template <typename K, typename V>
+void concurrent_kvfifo<K, V>::move_to_back(K const &k) {
+    kv_stripe &s = stripe(k);
+    std::unique_lock<std::mutex> guard(s.lock);
+    auto it = s.chains.find(k);
+    if (it == s.chains.end()) {
+        throw std::invalid_argument("No such key in the queue!");
+    }
+    kv_chain &chain = it->second;
+    std::vector<std::unique_ptr<kv_node>> moved;
+    moved.reserve(chain.count);
+    try {
+        for (kv_node *node = chain.head; node != nullptr;
+             node = node->next_same) {
+            moved.push_back(std::make_unique<kv_node>(
+                    node->key, std::move_if_noexcept(*node->value)));
+        }
+    } catch (...) {
+        if constexpr (std::is_nothrow_move_constructible_v<V>) {
+            kv_node *node = chain.head;
+            for (auto &copy : moved) {
+                node->value.emplace(std::move(*copy->value));
+                node = node->next_same;
+            }
+        }
+        throw;
+    }
+    for (size_t i = 0; i + 1 < moved.size(); ++i) {
+        moved[i]->next.store(moved[i + 1].get(), std::memory_order_relaxed);
+        moved[i]->next_same = moved[i + 1].get();
+    }
+    kv_node *node = std::exchange(chain.head, moved.front().get());
+    chain.tail = moved.back().get();
+    for (auto &copy : moved) {
+        copy.release();
+    }
+    link_back(chain.head, chain.tail);
+    removed_links.fetch_add(moved.size(), std::memory_order_relaxed);
+    // The front may free a node as soon as it is marked removed.
+    while (node != nullptr) {
+        kv_node *next_same = node->next_same;
+        node->value.reset();
+        node->removed.store(true, std::memory_order_release);
+        node = next_same;
+    }
+    guard.unlock();
+    reclaim_removed();
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::front() {
+    std::lock_guard<std::mutex> guard(front_lock);
+    std::unique_lock<std::mutex> stripe_lock;
+    kv_node *node = front_node(stripe_lock);
+    if (node == nullptr) {
+        throw std::invalid_argument("Queue is empty!");
+    }
+    return {node->key, *node->value};
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::first(K const &key) {
+    kv_stripe &s = stripe(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.chains.find(key);
+    if (it == s.chains.end()) {
+        throw std::invalid_argument("No such key in the queue!");
+    }
+    kv_node *node = it->second.head;
+    return {node->key, *node->value};
+}
+
+template <typename K, typename V>
+std::pair<K, V> concurrent_kvfifo<K, V>::last(K const &key) {
+    kv_stripe &s = stripe(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.chains.find(key);
+    if (it == s.chains.end()) {
+        throw std::invalid_argument("No such key in the queue!");
+    }
+    kv_node *node = it->second.tail;
+    return {node->key, *node->value};
+}
+
+template <typename K, typename V>
+size_t concurrent_kvfifo<K, V>::size() const noexcept {
+    return elements.load(std::memory_order_relaxed);
+}
+
+template <typename K, typename V>
+size_t concurrent_kvfifo<K, V>::count(K const &k) {
+    kv_stripe &s = stripe(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.chains.find(k);
+    return it == s.chains.end() ? 0 : it->second.count;
+}
+
+template <typename K, typename V>
+bool concurrent_kvfifo<K, V>::empty() const noexcept {
+    return size() == 0;
+}
+
+#endif  // __CONCURRENT_KVFIFO_H__
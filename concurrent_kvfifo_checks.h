@@ -0,0 +1,149 @@
+#ifndef __CONCURRENT_KVFIFO_CHECKS_H__
+#define __CONCURRENT_KVFIFO_CHECKS_H__
+
+// Checks shared by the tests of the queues many threads may use at once,
+// concurrent_kvfifo and sharded_kvfifo. Q is such a queue of int keys and
+// values.
+
+#include "kvfifo.h"
+#include <atomic>
+#include <cassert>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Checks that the queues hold the same elements in the same order, emptying
+// both.
+template <typename Q>
+void assert_same(Q &q, kvfifo<int, int> &model) {
+    assert(q.size() == model.size() && q.empty() == model.empty());
+    while (!model.empty()) {
+        auto [k, v] = q.front();
+        assert(k == model.front().first && v == model.front().second);
+        assert(q.count(k) == model.count(k));
+        assert(q.first(k).second == model.first(k).second);
+        assert(q.last(k).second == model.last(k).second);
+        auto popped = q.pop();
+        assert(popped.first == k && popped.second == v);
+        model.pop();
+    }
+    assert(q.empty());
+}
+
+// The operations of one thread, on a few elements.
+template <typename Q>
+void check_basics() {
+    int keys[] = {3, 1, 2};
+    Q q;
+    for (int i = 0; i < 3; ++i)
+        q.push(keys[i], i);
+    q.push(1, 3);
+    assert(q.size() == 4 && q.count(1) == 2 && q.count(4) == 0);
+    assert(q.front().second == 0 && q.first(1).second == 1);
+    assert(q.last(1).second == 3);
+    q.move_to_back(3);
+    assert(q.front().second == 1 && q.last(3).second == 0);
+    assert(q.pop(2).second == 2);
+    try {
+        q.pop(2);
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    assert(q.pop().second == 1 && q.pop().second == 3);
+    assert(q.pop().second == 0 && q.empty());
+    try {
+        q.pop();
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+}
+
+// Random operations of one thread, compared with kvfifo.
+template <typename Q>
+void check_against_model(unsigned seed) {
+    std::mt19937 rng(seed);
+    Q q;
+    kvfifo<int, int> model;
+    for (int i = 0; i < 10000; ++i) {
+        int k = int(rng() % 20);
+        switch (rng() % 4) {
+            case 0:
+            case 1:
+                q.push(k, i);
+                model.push(k, i);
+                break;
+            case 2:
+                if (model.count(k) > 0) {
+                    assert(q.pop(k).second == model.first(k).second);
+                    model.pop(k);
+                }
+                break;
+            default:
+                if (model.count(k) > 0) {
+                    q.move_to_back(k);
+                    model.move_to_back(k);
+                } else if (!model.empty()) {
+                    assert(q.pop().second == model.front().second);
+                    model.pop();
+                }
+        }
+    }
+    assert_same(q, model);
+}
+
+// Every element pushed by the producers is popped exactly once, and each
+// consumer gets the elements of a key in push order.
+template <typename Q>
+void check_producers_consumers() {
+    int const producers = 4, consumers = 4, per_producer = 20000;
+    int const total = producers * per_producer;
+    Q q;
+    std::atomic<int> consumed = 0;
+    std::vector<std::vector<std::pair<int, int>>> popped(consumers);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&q, p] {
+            for (int i = 0; i < per_producer; ++i) {
+                q.push(p, i);
+                // The consumers may have popped every element of p already.
+                if (i % 100 == 0) {
+                    try {
+                        q.move_to_back(p);
+                    } catch (std::invalid_argument const &) {}
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&, c] {
+            while (consumed.load() < total) {
+                try {
+                    // The last consumer pops by key.
+                    popped[c].push_back(c + 1 < consumers
+                                        ? q.pop() : q.pop(c % producers));
+                    ++consumed;
+                } catch (std::invalid_argument const &) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    assert(q.empty());
+    std::vector<int> seen(total, 0);
+    for (auto const &elements : popped) {
+        std::vector<int> last(producers, -1);
+        for (auto [k, v] : elements) {
+            assert(v > last[k]);
+            last[k] = v;
+            ++seen[k * per_producer + v];
+        }
+    }
+    for (int count : seen) {
+        assert(count == 1);
+    }
+}
+
+#endif  // __CONCURRENT_KVFIFO_CHECKS_H__
@@ -0,0 +1,278 @@
+#include "concurrent_kvfifo.h"
+#include "concurrent_kvfifo_checks.h"
+#include "single_thread_executor.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using cq = concurrent_kvfifo<int, int>;
+
+// The coroutines of the tests run on their own, with nobody awaiting them.
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+    };
+};
+
+// Pops n elements, of key k if there is one, checking that the values of each
+// key come in increasing order and that it runs on the executor thread.
+// The last consumer to finish stops the executor.
+detached consume(cq &q, single_thread_executor &executor, int n,
+                 std::optional<int> k, std::atomic<int> &running) {
+    std::thread::id thread = std::this_thread::get_id();
+    std::vector<int> last(8, -1);
+    for (int i = 0; i < n; ++i) {
+        auto [key, value] = k ? co_await q.async_pop(*k, executor)
+                              : co_await q.async_pop(executor);
+        assert(!k || key == *k);
+        assert(value > last[key]);
+        last[key] = value;
+        assert(std::this_thread::get_id() == thread);
+    }
+    if (--running == 0) {
+        executor.stop();
+    }
+}
+
+// Pops an element of k, asked for with a temporary key that is gone before
+// the element comes, into value.
+detached pop_by_temporary(cq &q, single_thread_executor &executor, int k,
+                          int &value) {
+    auto popping = q.async_pop(k + 0, executor);
+    value = (co_await popping).second;
+}
+
+// Its next move throws once fail_move is set, which it then clears.
+struct fragile_value {
+    static inline bool fail_move = false;
+
+    int a;
+
+    fragile_value(int a) : a(a) {}
+    fragile_value(fragile_value const &other) = default;
+    fragile_value(fragile_value &&other) : a(other.a) {
+        if (std::exchange(fail_move, false)) {
+            throw std::runtime_error("move failed");
+        }
+    }
+};
+
+// Pops any element into value, or counts the exception the pop threw.
+detached pop_or_fail(concurrent_kvfifo<int, fragile_value> &q,
+                     single_thread_executor &executor, int &value,
+                     int &failures) {
+    try {
+        value = (co_await q.async_pop(executor)).second.a;
+    } catch (std::runtime_error const &) {
+        ++failures;
+    }
+}
+
+// Counts its copies, to check which pushes copy the value.
+struct counted_value {
+    static inline int copies = 0;
+
+    int a;
+
+    counted_value(int a) : a(a) {}
+    counted_value(counted_value const &other) : a(other.a) {
+        ++copies;
+    }
+    counted_value(counted_value &&other) noexcept : a(other.a) {}
+};
+
+// A key that counts its live copies: every node holds one until it is freed.
+struct counted_key {
+    static inline std::atomic<long> live = 0;
+
+    int k;
+
+    counted_key(int key) : k(key) {
+        ++live;
+    }
+    counted_key(counted_key const &other) : k(other.k) {
+        ++live;
+    }
+    ~counted_key() {
+        --live;
+    }
+
+    bool operator==(counted_key const &other) const {
+        return k == other.k;
+    }
+};
+
+template <>
+struct std::hash<counted_key> {
+    size_t operator()(counted_key const &key) const noexcept {
+        return std::hash<int>()(key.k);
+    }
+};
+
+int main() {
+    check_basics<cq>();
+
+    concurrent_kvfifo<std::string, std::string> qs;
+    qs.emplace("a", 3, 'x');
+    qs.push(std::string("b"), std::string("y"));
+    assert(qs.front().second == "xxx" && qs.last("b").second == "y");
+
+    // A value passed by rvalue is moved in, whatever the key is passed by.
+    concurrent_kvfifo<int, counted_value> pushed;
+    int pushed_key = 1;
+    counted_value pushed_value(1);
+    pushed.push(pushed_key, counted_value(2));
+    pushed.push(pushed_key, std::move(pushed_value));
+    assert(counted_value::copies == 0);
+    pushed.push(2, pushed_value);
+    assert(counted_value::copies == 1);
+    assert(pushed.size() == 3 && pushed.count(1) == 2);
+
+    check_against_model<cq>(0);
+
+    // Elements moved or popped by key behind a front element that stays put
+    // do not keep their nodes.
+    concurrent_kvfifo<counted_key, int> qk;
+    qk.push(0, 0);
+    for (int i = 0; i < 100; ++i) {
+        qk.push(1, i);
+    }
+    long live_before = counted_key::live;
+    for (int i = 0; i < 1000; ++i) {
+        qk.move_to_back(1);
+        assert(counted_key::live < live_before + 200);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        qk.push(2, i);
+        assert(qk.pop(2).second == i);
+        assert(counted_key::live < live_before + 200);
+    }
+    assert(qk.size() == 101 && qk.front().second == 0);
+    assert(qk.first(1).second == 0 && qk.last(1).second == 99);
+
+    // Waiting pops sleep until there is an element for them.
+    cq q4;
+    assert(!q4.pop_wait_for(std::chrono::milliseconds(10)));
+    q4.push(1, 1);
+    assert(q4.pop_wait_for(std::chrono::milliseconds(10))->second == 1);
+    std::thread waiter([&q4] {
+        assert(q4.pop_wait(2).second == 20);
+        assert(q4.pop_wait().second == 10);
+        assert(q4.pop_wait().second == 30);
+    });
+    q4.push(1, 10);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    q4.push(2, 20);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    q4.push(3, 30);
+    waiter.join();
+    assert(q4.empty());
+
+    // Consumers that only wait share the elements of the producers.
+    int const waiting_consumers = 4, per_consumer = 10000;
+    std::atomic<long> sum = 0;
+    std::vector<std::thread> waiters;
+    for (int c = 0; c < waiting_consumers; ++c) {
+        waiters.emplace_back([&q4, &sum, c] {
+            for (int i = 0; i < per_consumer; ++i) {
+                if (c % 2 == 0) {
+                    sum += q4.pop_wait().second;
+                } else {
+                    std::optional<std::pair<int, int>> element;
+                    while (!(element = q4.pop_wait_for(
+                                     std::chrono::microseconds(50)))) {
+                    }
+                    sum += element->second;
+                }
+            }
+        });
+    }
+    for (int i = 0; i < waiting_consumers * per_consumer; ++i) {
+        q4.push(i % 7, i);
+    }
+    for (auto &thread : waiters) {
+        thread.join();
+    }
+    long n = waiting_consumers * per_consumer;
+    assert(q4.empty() && sum == n * (n - 1) / 2);
+
+    // Coroutines wait for elements without a thread, and resume on the
+    // executor.
+    single_thread_executor executor;
+    std::atomic<int> running = 2;
+    q4.push(1, 1);
+    consume(q4, executor, 2, std::nullopt, running);
+    assert(q4.empty() && running == 2);
+    consume(q4, executor, 1, 2, running);
+    q4.push(3, 2);
+    assert(executor.run_ready() == 1 && running == 1);
+    q4.push(1, 3);
+    assert(executor.run_ready() == 0 && q4.size() == 1);
+    q4.push(2, 4);
+    assert(executor.run_ready() == 1 && running == 0);
+    assert(q4.size() == 1 && q4.pop().second == 3);
+    int popped_value = -1;
+    pop_by_temporary(q4, executor, 5, popped_value);
+    q4.push(6, 8);
+    q4.push(5, 9);
+    assert(executor.run_ready() == 1 && popped_value == 9);
+    assert(q4.size() == 1 && q4.pop().second == 8);
+
+    // A coroutine resumes with the exception that popping for it threw, and
+    // the element stays in the queue.
+    concurrent_kvfifo<int, fragile_value> qf;
+    int fragile_popped = -1, failures = 0;
+    pop_or_fail(qf, executor, fragile_popped, failures);
+    fragile_value const fragile(7);
+    fragile_value::fail_move = true;
+    qf.push(1, fragile);
+    assert(executor.run_ready() == 1 && failures == 1 && qf.size() == 1);
+    pop_or_fail(qf, executor, fragile_popped, failures);
+    assert(fragile_popped == 7 && failures == 1 && qf.empty());
+
+    // Producer threads feed coroutines popping any key from one queue and
+    // coroutines popping one key each from another.
+    int const async_consumers = 4, per_async = 5000;
+    cq any, keyed;
+    single_thread_executor feeding;
+    running = 2 * async_consumers;
+    for (int c = 0; c < async_consumers; ++c) {
+        consume(any, feeding, per_async, std::nullopt, running);
+        consume(keyed, feeding, per_async, c, running);
+    }
+    std::vector<std::thread> feeders;
+    for (int p = 0; p < async_consumers; ++p) {
+        feeders.emplace_back([&any, &keyed, p] {
+            for (int i = 0; i < per_async; ++i) {
+                any.push(p, i);
+                keyed.push(p, i);
+            }
+        });
+    }
+    feeding.run();
+    for (auto &thread : feeders) {
+        thread.join();
+    }
+    assert(running == 0 && any.empty() && keyed.empty());
+
+    check_producers_consumers<cq>();
+}
@@ -1,47 +1,357 @@
 #ifndef __KVFIFO_H__
 #define __KVFIFO_H__
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cstddef>
-#include <list>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
-#include <set>
+#include <memory_resource>
+#include <mutex>
 #include <stdexcept>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
-template <typename K, typename V>
+#ifdef KVFIFO_STATS
+#include <chrono>
+#endif
+
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define KVFIFO_HAS_SINGLE_THREADED 1
+#endif
+
+// Key index backends of kvfifo.
+namespace kvfifo_policy {
+    // Balanced tree: keyed operations in O(log n), keys iterated in order
+    // directly by the tree. This is the default.
+    struct ordered_index {
+        template <typename K, typename T, typename Alloc>
+        using map = std::map<K, T, std::less<K>, Alloc>;
+
+        static constexpr bool sorted = true;
+    };
+
+    // Hash table (needs std::hash<K> and operator==): keyed operations in
+    // O(1) expected. k_begin and k_end sort a view of the keys when called
+    // for the first time after a key was added or removed, which costs
+    // O(k log k) for k distinct keys and may throw. Copies sharing the keys
+    // sort them under a mutex, so they may do so in different threads.
+    struct hashed_index {
+        template <typename K, typename T, typename Alloc>
+        using map = std::unordered_map<K, T, std::hash<K>, std::equal_to<K>,
+                                       Alloc>;
+
+        static constexpr bool sorted = false;
+    };
+
+    // Reference counts of the shared state. With atomic_count, the default,
+    // copies of a queue may be used and destroyed in different threads, as
+    // long as each copy is used by one thread at a time. plain_count saves
+    // the atomic operations when all copies stay in one thread.
+    //
+    // Like std::shared_ptr in libstdc++, atomic_count skips the locked
+    // instructions while the process has only one thread.
+    class atomic_count {
+    public:
+        void acquire() noexcept {
+            if (single_threaded()) {
+                refs.store(refs.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+            } else {
+                refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Whether the last reference was released.
+        bool release() noexcept {
+            if (single_threaded()) {
+                size_t old = refs.load(std::memory_order_relaxed);
+                refs.store(old - 1, std::memory_order_relaxed);
+                return old == 1;
+            }
+            return refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+
+        bool is_shared() const noexcept {
+            return refs.load(std::memory_order_acquire) > 1;
+        }
+
+        static constexpr bool atomic = true;
+
+    private:
+        std::atomic<size_t> refs{1};
+
+        static bool single_threaded() noexcept {
+#ifdef KVFIFO_HAS_SINGLE_THREADED
+            return __libc_single_threaded;
+#else
+            return false;
+#endif
+        }
+    };
+
+    class plain_count {
+    public:
+        void acquire() noexcept { ++refs; }
+        bool release() noexcept { return --refs == 0; }
+        bool is_shared() const noexcept { return refs > 1; }
+
+        static constexpr bool atomic = false;
+
+    private:
+        size_t refs = 1;
+    };
+}
+
+// How often and how expensively queues copied a state they shared, counted
+// when KVFIFO_STATS is defined. Each queue counts the copies made for it, and
+// kvfifo_global_stats() adds up those of all queues. Without KVFIFO_STATS
+// nothing is counted and neither of them exists.
+struct kvfifo_stats {
+    // The operations that copy a shared state. modify_front and the others
+    // count as the accessor of the same name.
+    enum site {
+        copy_constructor,
+        push,
+        pop,
+        pop_key,
+        move_to_back,
+        move_to_front,
+        front,
+        back,
+        first,
+        last,
+        sites
+    };
+
+    std::array<std::uint64_t, sites> detaches{};
+    // Elements and keys in the copies, and the bytes of their nodes.
+    std::uint64_t elements_copied = 0;
+    std::uint64_t keys_copied = 0;
+    std::uint64_t bytes_copied = 0;
+    std::uint64_t copy_ns = 0;
+};
+
+#ifdef KVFIFO_STATS
+namespace kvfifo_detail {
+    struct global_stats {
+        std::array<std::atomic<std::uint64_t>, kvfifo_stats::sites> detaches{};
+        std::atomic<std::uint64_t> elements_copied{0};
+        std::atomic<std::uint64_t> keys_copied{0};
+        std::atomic<std::uint64_t> bytes_copied{0};
+        std::atomic<std::uint64_t> copy_ns{0};
+    };
+
+    inline global_stats stats;
+}
+
+inline kvfifo_stats kvfifo_global_stats() noexcept {
+    auto &global = kvfifo_detail::stats;
+    kvfifo_stats stats;
+    for (size_t i = 0; i < kvfifo_stats::sites; ++i) {
+        stats.detaches[i] = global.detaches[i].load(std::memory_order_relaxed);
+    }
+    stats.elements_copied =
+            global.elements_copied.load(std::memory_order_relaxed);
+    stats.keys_copied = global.keys_copied.load(std::memory_order_relaxed);
+    stats.bytes_copied = global.bytes_copied.load(std::memory_order_relaxed);
+    stats.copy_ns = global.copy_ns.load(std::memory_order_relaxed);
+    return stats;
+}
+#endif
+
+// Every allocation of a queue, including its shared state and the nodes
+// made when a copy detaches, goes through an allocator rebound from Alloc.
+// A detached copy keeps the allocator of the state it was copied from.
+//
+// An empty queue allocates nothing unless it was given a stateful allocator
+// to remember. The shared state has room for the nodes of a few elements and
+// their keys, so a small queue costs a single allocation.
+template <typename K, typename V,
+          typename Index = kvfifo_policy::ordered_index,
+          typename Alloc = std::allocator<std::pair<K const, V>>,
+          typename RefCount = kvfifo_policy::atomic_count>
 class kvfifo {
 private:
-    using k_set = std::set<K>;
-    using kv_queue = std::list<std::pair<typename k_set::iterator, V>>;
-    using kv_map = std::map<K, std::list<typename kv_queue::iterator>>;
+    template <typename T>
+    using rebind_alloc =
+            typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+    struct kv_node;
+    struct kv_slots;
 
-    std::shared_ptr<k_set> keys;
-    std::shared_ptr<kv_queue> queue;
-    std::shared_ptr<kv_map> iters;
+    template <typename T>
+    class kv_slot_allocator;
+
+    // Index record of a key: how many elements have it and which of them are
+    // the first and the last one in the queue.
+    struct kv_chain {
+        size_t count = 0;
+        kv_node *head = nullptr;
+        kv_node *tail = nullptr;
+    };
+
+    using kv_entry = std::pair<K const, kv_chain>;
+    using kv_map = typename Index::template map<
+            K, kv_chain, kv_slot_allocator<kv_entry>>;
+    using kv_view = std::vector<kv_entry const *,
+                                rebind_alloc<kv_entry const *>>;
+    using key_iterator = std::conditional_t<Index::sorted,
+            typename kv_map::const_iterator, typename kv_view::const_iterator>;
+
+    // The only allocation made for an element. Besides the value it holds
+    // the links of the queue and the links of the list of elements with the
+    // same key, so neither of them needs nodes of its own.
+    struct kv_node {
+        kv_entry *entry;
+        kv_node *prev = nullptr;
+        kv_node *next = nullptr;
+        kv_node *prev_same = nullptr;
+        kv_node *next_same = nullptr;
+        V value;
+
+        template <typename... Args>
+        explicit kv_node(kv_entry *entry, Args &&...args)
+            : entry(entry), value(std::forward<Args>(args)...) {}
+    };
+
+    // A slot fits an element node or, with some room for the bookkeeping of
+    // the index, a key record. Slots take at most 512 bytes of the state.
+    static constexpr size_t slot_align = alignof(std::max_align_t);
+    static constexpr size_t slot_size =
+            (std::max(sizeof(kv_node), sizeof(kv_entry) + 4 * sizeof(void *))
+             + slot_align - 1) / slot_align * slot_align;
+    static constexpr size_t small_slots = std::min<size_t>(8, 512 / slot_size);
+
+    class kv_queue;
+    struct kv_overlay;
+
+    // Counted reference to the shared state. Null when the queue is empty
+    // and has no allocator to remember.
+    kv_queue *queue;
+    // Changes this queue made to a state it shares, or null.
+    kv_overlay *overlay;
     bool modifiable_from_outside;
+#ifdef KVFIFO_STATS
+    // Stays with this object when it swaps its state with another.
+    kvfifo_stats detach_stats;
+#endif
+
+    static kv_queue *make_queue(Alloc const &alloc);
+    static void release(kv_queue *queue) noexcept;
+
+    template <typename... Args>
+    static kv_overlay *make_overlay(Alloc const &alloc, Args &&...args);
+    static void destroy_overlay(kv_overlay *overlay,
+                                Alloc const &alloc) noexcept;
 
     bool is_copy_needed() const noexcept;
-    void copy_if_needed();
+    void copy_if_needed(kvfifo_stats::site site);
     kvfifo create_copy() const;
+    kvfifo counted_copy(kvfifo const &from, kvfifo_stats::site site);
+    bool can_overlay(size_t changes) const noexcept;
+    bool can_pop_front() const noexcept;
+    kv_overlay &get_overlay();
+    void settle();
 
     void swap(kvfifo &other) noexcept;
 
+    void check_not_empty() const;
+    typename kv_map::iterator find_key(K const &k) const;
+    typename kv_map::iterator find_own_key(K const &k,
+                                           kvfifo_stats::site site);
+    typename kv_map::iterator own_key(typename kv_map::iterator it,
+                                      kvfifo_stats::site site);
+
+    kv_node *front_node() const noexcept;
+    kv_node *back_node() const noexcept;
+    kv_node *first_node(kv_entry const &entry) const noexcept;
+    kv_node *last_node(kv_entry const &entry) const noexcept;
+
+    template <typename Key, typename... Args>
+    void emplace_key(Key &&k, Args &&...args);
+    template <typename Take>
+    void take_all(K const &k, Take take);
+
 public:
+    using allocator_type = Alloc;
+    using pmr = kvfifo<K, V, Index,
+            std::pmr::polymorphic_allocator<std::pair<K const, V>>, RefCount>;
+
     kvfifo();
+    explicit kvfifo(Alloc const &alloc);
     kvfifo(kvfifo const &);
     kvfifo(kvfifo &&) noexcept;
     ~kvfifo() noexcept;
 
     kvfifo& operator=(kvfifo other);
 
+    // If push or emplace throws, the queue is unchanged, although a key or
+    // value passed by rvalue may have been moved from. emplace constructs
+    // the value in place from args.
     void push(K const &k, V const &v);
+    void push(K const &k, V &&v);
+    void push(K &&k, V const &v);
+    void push(K &&k, V &&v);
+
+    template <typename... Args>
+    void emplace(K const &k, Args &&...args);
+    template <typename... Args>
+    void emplace(K &&k, Args &&...args);
+
+    // Pushes the (key, value) pairs of the range in order, looking each
+    // distinct key up once. The range is walked more than once, so It must
+    // be at least a forward iterator. If it throws, the queue is unchanged,
+    // with the same proviso about rvalues as push.
+    template <typename It>
+    void push_range(It first, It last);
 
     void pop();
     void pop(K const &);
 
+    // Pop every element with the key, in O(m + log n) for m of them; the
+    // second one writes their values to out in queue order and returns out
+    // past the last. The values are moved out unless the state is shared. If
+    // writing a value throws, the elements before it stay popped and it and
+    // the rest stay in the queue, although its value may have been moved
+    // from.
+    void pop_all(K const &k);
+    template <typename OutIt>
+    OutIt pop_all(K const &k, OutIt out);
+
+    // Pop up to n elements from the front, writing each to out as a
+    // std::pair<K, V> first, and return out past the last one. The values
+    // are moved out unless the state is shared, and a key is only looked up
+    // when its last element goes. If writing an element throws, the elements
+    // before it stay popped and it and the rest stay in the queue, although
+    // its value may have been moved from.
+    template <typename OutIt>
+    OutIt pop_n(size_t n, OutIt out);
+    template <typename OutIt>
+    OutIt drain(OutIt out);
+
     void move_to_back(K const &k);
+    // Does what move_to_back of each key of the range in turn would, with at
+    // most one copy of a shared state. If a key is not in the queue, it
+    // throws before anything moves; if it throws, the queue is unchanged.
+    template <std::input_iterator It>
+    void move_to_back(It first_key, It last_key);
+    // Moves the elements with the key to the front of the queue, in their
+    // order. The changes kept next to a shared state only append at the
+    // back, so this copies a shared state, unless the queue has not changed
+    // since it was copied and the elements already are at the front.
+    void move_to_front(K const &k);
 
     std::pair<K const &, V &> front();
     std::pair<K const &, V const &> front() const;
@@ -53,278 +363,2088 @@ public:
     std::pair<K const &, V &> last(K const &key);
     std::pair<K const &, V const &> last(K const &key) const;
 
+    // Call fn on the value of the element and return what it returns. Unlike
+    // the references returned by the non-const front, back, first and last,
+    // fn leaves nothing behind that could modify the queue later, so copies
+    // made afterwards still share its state. If fn throws, the value keeps
+    // what fn did to it.
+    template <typename F>
+    decltype(auto) modify_front(F &&fn);
+    template <typename F>
+    decltype(auto) modify_back(F &&fn);
+    template <typename F>
+    decltype(auto) modify_first(K const &key, F &&fn);
+    template <typename F>
+    decltype(auto) modify_last(K const &key, F &&fn);
+
     size_t size() const noexcept;
     size_t count(K const &) const;
     bool empty() const noexcept;
 
     void clear();
 
-    using k_iterator = k_set::const_iterator;
+    Alloc get_allocator() const noexcept;
+
+    class k_iterator;
+
+    k_iterator k_begin() const noexcept(Index::sorted);
+    k_iterator k_end() const noexcept(Index::sorted);
 
-    k_iterator k_begin() const noexcept;
-    k_iterator k_end() const noexcept;
+    class snapshot_view;
+
+    // Read-only view of the current contents, which readers in other threads
+    // may use while this queue keeps changing. Costs what a copy costs.
+    snapshot_view snapshot() const;
+
+#ifdef KVFIFO_STATS
+    kvfifo_stats const &stats() const noexcept { return detach_stats; }
+#endif
 };
 
-template <typename K, typename V>
-kvfifo<K, V>::kvfifo()
-    : keys(std::make_shared<k_set>()),
-      queue(std::make_shared<kv_queue>()),
-      iters(std::make_shared<kv_map>()),
-      modifiable_from_outside(false) {}
+// Fixed storage for the first nodes allocated by a queue.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+struct kvfifo<K, V, Index, Alloc, RefCount>::kv_slots {
+    struct alignas(slot_align) slot {
+        std::byte bytes[slot_size];
+    };
 
-template <typename K, typename V>
-kvfifo<K, V>::kvfifo(kvfifo<K, V> const &other)
-    : keys(other.keys),
-      queue(other.queue),
-      iters(other.iters),
-      modifiable_from_outside(false) {
-    if (other.modifiable_from_outside) {
-        create_copy().swap(*this);
+    std::array<slot, small_slots> slots;
+    unsigned used = 0;
+
+    void *take() noexcept;
+    bool give_back(void *p) noexcept;
+};
+
+// Serves single objects that fit from the slots of the queue and everything
+// else from the rebound Alloc.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename T>
+class kvfifo<K, V, Index, Alloc, RefCount>::kv_slot_allocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = kv_slot_allocator<U>;
+    };
+
+    kv_slot_allocator(kv_slots *slots, Alloc const &upstream) noexcept
+        : slots(slots), upstream(upstream) {}
+
+    template <typename U>
+    kv_slot_allocator(kv_slot_allocator<U> const &other) noexcept
+        : slots(other.slots), upstream(other.upstream) {}
+
+    T *allocate(size_t n) {
+        if (n == 1 && sizeof(T) <= slot_size && alignof(T) <= slot_align) {
+            if (void *p = slots->take()) {
+                return static_cast<T *>(p);
+            }
+        }
+        return upstream_traits::allocate(upstream, n);
     }
-}
 
-template <typename K, typename V>
-kvfifo<K, V>::kvfifo(kvfifo<K, V> &&) noexcept = default;
+    void deallocate(T *p, size_t n) noexcept {
+        if (!slots->give_back(p)) {
+            upstream_traits::deallocate(upstream, p, n);
+        }
+    }
 
-template <typename K, typename V>
-kvfifo<K, V>::~kvfifo() noexcept = default;
+    // Lets allocators such as std::pmr::polymorphic_allocator pass
+    // themselves on to the keys.
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&...args) {
+        upstream_traits::construct(upstream, p, std::forward<Args>(args)...);
+    }
 
-template <typename K, typename V>
-kvfifo<K, V>& kvfifo<K, V>::operator=(kvfifo<K, V> other) {
-    swap(other);
-    return *this;
+    friend bool operator==(kv_slot_allocator const &a,
+                           kv_slot_allocator const &b) noexcept {
+        return a.slots == b.slots && a.upstream == b.upstream;
+    }
+
+    Alloc upstream_allocator() const noexcept {
+        return Alloc(upstream);
+    }
+
+private:
+    template <typename>
+    friend class kv_slot_allocator;
+
+    using upstream_traits = std::allocator_traits<rebind_alloc<T>>;
+
+    kv_slots *slots;
+    rebind_alloc<T> upstream;
+};
+
+// Changes a queue made to a state it shares with other copies, which the
+// state itself must not see. Made by the first such change; once the queue
+// has the state to itself again, they are applied to it for real and the
+// overlay goes away.
+//
+// Elements are only ever removed first in the list of their key, so the gone
+// elements of a key are the first ones in the state. The queue seen through
+// the overlay is the elements of the state from head on that are neither gone
+// nor moved, followed by back: the elements of moved keys and the elements
+// pushed since, whose nodes belong to the overlay. Except for pops from the
+// front, every change adds to changes, and the queue detaches once it would
+// exceed limit; a read walks through at most that many elements. Pops from the
+// front are only bounded by is_worn, which keeps the keys k_iterator skips
+// and the memory of the overlay in proportion to the queue.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+class kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay {
+public:
+    struct key_delta {
+        // The first removed elements of the key in the state are gone.
+        size_t removed;
+        kv_node *first_left;
+        // Elements of the key in back with nodes of their own.
+        size_t appended = 0;
+        // Whether the elements left in the state are in back.
+        bool moved = false;
+    };
+
+    struct back_element {
+        kv_node *node;
+        bool own;
+    };
+
+    static constexpr size_t limit = 64;
+
+    // First element of the state that is in the queue and not in back.
+    kv_node *head;
+    size_t removed = 0;
+    size_t appended = 0;
+    size_t changes = 0;
+    size_t moved_keys = 0;
+    // Keys with no elements left, which k_iterator skips.
+    size_t dead_keys = 0;
+
+    kv_overlay(Alloc const &alloc, kv_node *head);
+    kv_overlay(kv_overlay const &other);
+    kv_overlay& operator=(kv_overlay const &) = delete;
+    ~kv_overlay() noexcept;
+
+    key_delta const *find(kv_entry const &entry) const noexcept {
+        auto it = keys.find(&entry);
+        return it == keys.end() ? nullptr : &it->second;
+    }
+
+    bool is_dead(kv_entry const &entry) const noexcept {
+        if (dead_keys == 0) {
+            return false;
+        }
+        key_delta const *d = find(entry);
+        return d != nullptr && d->removed == entry.second.count
+               && d->appended == 0;
+    }
+
+    bool fits(size_t more_changes) const noexcept {
+        return changes + more_changes <= limit;
+    }
+
+    // Whether the removed elements are at least limit and at least the size
+    // of the queue, so that a copy of what is left costs no more than the
+    // removals made since the overlay was made.
+    bool is_worn(size_t size) const noexcept {
+        return removed >= limit && removed >= size;
+    }
+
+    size_t count(kv_entry const &entry) const noexcept;
+    kv_node *front() const noexcept;
+    kv_node *back_node(kv_queue const &state) const noexcept;
+    kv_node *first(kv_entry const &entry) const noexcept;
+    kv_node *last(kv_entry const &entry) const noexcept;
+
+    // Whether an element of the state from head on is not where it is.
+    bool is_gone(kv_node const *node) const noexcept;
+
+    void pop_first(kv_entry const &entry);
+    template <typename... Args>
+    void emplace_back(kv_entry *entry, Args &&...args);
+    void move_to_back(kv_entry const &entry);
+    template <typename It>
+    void prepare_moves(It first, It last);
+
+private:
+    friend class kv_queue;
+
+    using delta_map = std::unordered_map<
+            kv_entry const *, key_delta, std::hash<kv_entry const *>,
+            std::equal_to<kv_entry const *>,
+            rebind_alloc<std::pair<kv_entry const *const, key_delta>>>;
+    using node_set = std::unordered_set<
+            kv_node const *, std::hash<kv_node const *>,
+            std::equal_to<kv_node const *>, rebind_alloc<kv_node const *>>;
+    using back_list = std::vector<back_element, rebind_alloc<back_element>>;
+    using node_allocator = rebind_alloc<kv_node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    // The keys with elements removed, appended or moved.
+    delta_map keys;
+    // Gone elements after head.
+    node_set removed_after_head;
+    back_list back;
+    node_allocator allocator;
+
+    key_delta &delta(kv_entry const &entry);
+    void skip_gone() noexcept;
+    void destroy_node(kv_node *node) noexcept;
+};
+
+// Shared state of the copies of a queue: the elements linked in the queue
+// order and the key index pointing at the per-key lists.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+class kvfifo<K, V, Index, Alloc, RefCount>::kv_queue {
+private:
+    kv_slots slots;
+
+public:
+    RefCount refs;
+    kv_map index;
+    kv_node *head = nullptr;
+    kv_node *tail = nullptr;
+    size_t size = 0;
+
+    // Keys sorted for k_iterator, used only by unsorted indexes. It stays
+    // valid as long as no key is added or removed. Keys only change while
+    // the state is not shared, but copies sharing it may sort the view in
+    // different threads: that happens under view_lock, and view_valid
+    // publishes the result.
+    mutable kv_view view;
+    mutable std::atomic<bool> view_valid = false;
+    mutable std::mutex view_lock;
+
+    explicit kv_queue(Alloc const &alloc);
+    kv_queue(kv_queue const &) = delete;
+    kv_queue& operator=(kv_queue const &) = delete;
+    ~kv_queue() noexcept;
+
+    void assign(kv_queue const &other, kv_overlay const *overlay);
+
+    template <typename Key, typename... Args>
+    void emplace_back(Key &&k, Args &&...args);
+    template <typename It>
+    void append_range(It first, It last);
+    void pop_front();
+    template <typename OutIt>
+    OutIt pop_front_n(size_t n, OutIt out);
+    void pop_first(typename kv_map::iterator it) noexcept;
+    template <typename Take>
+    void pop_all(typename kv_map::iterator it, Take take);
+    void move_to_back(kv_chain const &chain) noexcept;
+    bool is_at_back(kv_chain const &chain) const noexcept;
+    void move_to_front(kv_chain const &chain) noexcept;
+    bool is_at_front(kv_chain const &chain) const noexcept;
+    void merge(kv_overlay &overlay);
+
+    Alloc get_allocator() const noexcept;
+
+    key_iterator keys_begin() const noexcept(Index::sorted);
+    key_iterator keys_end() const noexcept(Index::sorted);
+
+private:
+    using node_allocator = kv_slot_allocator<kv_node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    node_allocator allocator;
+
+    void destroy_node(kv_node *node) noexcept;
+
+    void append(kv_node *node) noexcept;
+    void link_back(kv_node *first, kv_node *last) noexcept;
+    void link_front(kv_node *first, kv_node *last) noexcept;
+    void unlink(kv_node *first, kv_node *last) noexcept;
+    void erase_first(kv_chain &chain) noexcept;
+
+    using kv_inserted = std::vector<typename kv_map::iterator,
+                                    rebind_alloc<typename kv_map::iterator>>;
+    template <typename Batch>
+    void find_entries(Batch &batch, kv_inserted &inserted);
+
+    void sort_view() const;
+};
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+class kvfifo<K, V, Index, Alloc, RefCount>::k_iterator {
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = K;
+    using difference_type = std::ptrdiff_t;
+    using pointer = K const *;
+    using reference = K const &;
+
+    k_iterator() = default;
+
+    reference operator*() const noexcept { return entry().first; }
+
+    pointer operator->() const noexcept { return &**this; }
+
+    k_iterator& operator++() noexcept {
+        ++it;
+        skip_dead_keys();
+        return *this;
+    }
+
+    k_iterator operator++(int) noexcept {
+        k_iterator old = *this;
+        ++*this;
+        return old;
+    }
+
+    k_iterator& operator--() noexcept {
+        do {
+            --it;
+        } while (overlay != nullptr && overlay->is_dead(entry()));
+        return *this;
+    }
+
+    k_iterator operator--(int) noexcept {
+        k_iterator old = *this;
+        --*this;
+        return old;
+    }
+
+    bool operator==(k_iterator const &) const noexcept = default;
+
+private:
+    friend class kvfifo;
+
+    // With an overlay, skips the keys with no elements left.
+    k_iterator(key_iterator it, key_iterator end,
+               kv_overlay const *overlay) noexcept
+        : it(it), end(end), overlay(overlay) {
+        skip_dead_keys();
+    }
+
+    kv_entry const &entry() const noexcept {
+        if constexpr (Index::sorted) {
+            return *it;
+        } else {
+            return **it;
+        }
+    }
+
+    void skip_dead_keys() noexcept {
+        while (overlay != nullptr && it != end && overlay->is_dead(entry())) {
+            ++it;
+        }
+    }
+
+    key_iterator it;
+    key_iterator end;
+    kv_overlay const *overlay = nullptr;
+};
+
+// Holds a counted reference to the state, so a queue that shares it with a
+// live snapshot detaches before changing it. Readers never write to the
+// state: the keys of an unsorted index are sorted when the snapshot is taken.
+// Any number of threads may read one snapshot at the same time, and copies
+// of it may be handed to further threads.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+class kvfifo<K, V, Index, Alloc, RefCount>::snapshot_view {
+public:
+    snapshot_view() = default;
+
+    std::pair<K const &, V const &> front() const { return queue.front(); }
+    std::pair<K const &, V const &> back() const { return queue.back(); }
+
+    std::pair<K const &, V const &> first(K const &key) const {
+        return queue.first(key);
+    }
+
+    std::pair<K const &, V const &> last(K const &key) const {
+        return queue.last(key);
+    }
+
+    size_t size() const noexcept { return queue.size(); }
+    size_t count(K const &k) const { return queue.count(k); }
+    bool empty() const noexcept { return queue.empty(); }
+
+    k_iterator k_begin() const noexcept { return queue.k_begin(); }
+    k_iterator k_end() const noexcept { return queue.k_end(); }
+
+private:
+    friend class kvfifo;
+
+    explicit snapshot_view(kvfifo const &queue) : queue(queue) {}
+
+    kvfifo queue;
+};
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::kv_queue(Alloc const &alloc)
+    : index(typename kv_map::allocator_type(&slots, alloc)),
+      view(typename kv_view::allocator_type(alloc)),
+      allocator(&slots, alloc) {}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+Alloc kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::get_allocator() const
+        noexcept {
+    return allocator.upstream_allocator();
 }
 
-template <typename K, typename V>
-bool kvfifo<K, V>::is_copy_needed() const noexcept {
-    return queue.use_count() > 1;
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void *kvfifo<K, V, Index, Alloc, RefCount>::kv_slots::take() noexcept {
+    for (size_t i = 0; i < small_slots; ++i) {
+        if ((used & (1u << i)) == 0) {
+            used |= 1u << i;
+            return &slots[i];
+        }
+    }
+    return nullptr;
 }
 
-template <typename K, typename V>
-void kvfifo<K, V>::copy_if_needed() {
-    if (is_copy_needed()) {
-        create_copy().swap(*this);
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::kv_slots::give_back(
+        void *p) noexcept {
+    auto *s = static_cast<slot *>(p);
+    std::less<slot *> before;
+    if (before(s, slots.data()) || !before(s, slots.data() + small_slots)) {
+        return false;
     }
+    used &= ~(1u << (s - slots.data()));
+    return true;
 }
 
-template <typename K, typename V>
-kvfifo<K, V> kvfifo<K, V>::create_copy() const {
-    kvfifo<K, V> copy;
-    copy.keys = std::make_shared<k_set>(*keys);
-    copy.queue = std::make_shared<kv_queue>(*queue);
-    copy.iters = std::make_shared<kv_map>(*iters);
-    for (auto it = copy.queue->begin(); it != copy.queue->end(); ++it) {
-        it->first = copy.keys->find(*it->first);
-        auto map_it = copy.iters->find(*it->first);
-        map_it->second.pop_front();
-        map_it->second.push_back(it);
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::~kv_queue() noexcept {
+    while (head != nullptr) {
+        kv_node *next = head->next;
+        destroy_node(head);
+        head = next;
     }
-    return copy;
 }
 
-template <typename K, typename V>
-void kvfifo<K, V>::swap(kvfifo<K, V> &other) noexcept {
-    other.keys.swap(keys);
-    other.queue.swap(queue);
-    other.iters.swap(iters);
-    std::swap(other.modifiable_from_outside, modifiable_from_outside);
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::destroy_node(
+        kv_node *node) noexcept {
+    node_traits::destroy(allocator, node);
+    node_traits::deallocate(allocator, node, 1);
+}
+
+// Appends the already unlinked range first..last of the queue.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::link_back(
+        kv_node *first, kv_node *last) noexcept {
+    first->prev = tail;
+    last->next = nullptr;
+    (tail != nullptr ? tail->next : head) = first;
+    tail = last;
+}
+
+// Prepends the already unlinked range first..last of the queue.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::link_front(
+        kv_node *first, kv_node *last) noexcept {
+    first->prev = nullptr;
+    last->next = head;
+    (head != nullptr ? head->prev : tail) = last;
+    head = first;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::unlink(
+        kv_node *first, kv_node *last) noexcept {
+    (first->prev != nullptr ? first->prev->next : head) = last->next;
+    (last->next != nullptr ? last->next->prev : tail) = first->prev;
+}
+
+// Links a node constructed for its record at the back of the queue and of the
+// list of its key.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::append(
+        kv_node *node) noexcept {
+    kv_chain &chain = node->entry->second;
+    node->prev_same = chain.tail;
+    (chain.tail != nullptr ? chain.tail->next_same : chain.head) = node;
+    chain.tail = node;
+    ++chain.count;
+    link_back(node, node);
+    ++size;
+}
+
+// Rebuilds other, as seen through the overlay if any, in this (empty) queue in
+// O(n). The records are copied first,
+// in the order of the index, so a sorted index only ever appends at its end.
+// The elements then find the copy of their record in a table indexed by the
+// address of the original one instead of searching the index. The shared
+// state of other is only read, as other copies may be detaching from it at
+// the same time. On exception the nodes created so far are released by the
+// destructor.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::assign(
+        kv_queue const &other, kv_overlay const *overlay) {
+    using clone = std::pair<kv_entry const *, kv_entry *>;
+    int bits = 1;
+    while ((size_t(1) << bits) < 2 * other.index.size()) {
+        ++bits;
+    }
+    size_t const mask = (size_t(1) << bits) - 1;
+    std::vector<clone, rebind_alloc<clone>> clones(
+            mask + 1, clone(), rebind_alloc<clone>(get_allocator()));
+    // Fibonacci hashing, with linear probing among the neighbouring slots.
+    auto slot_of = [&](kv_entry const *entry) noexcept {
+        auto address = std::uint64_t(reinterpret_cast<std::uintptr_t>(entry));
+        auto i = size_t((address * 0x9e3779b97f4a7c15u) >> (64 - bits));
+        while (clones[i].first != nullptr && clones[i].first != entry) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    };
+
+    if constexpr (requires { index.reserve(size_t()); }) {
+        index.reserve(other.index.size());
+    }
+    for (kv_entry const &entry : other.index) {
+        if (overlay != nullptr && overlay->is_dead(entry)) {
+            continue;
+        }
+        auto it = index.try_emplace(index.end(), entry.first);
+        clones[slot_of(&entry)] = clone(&entry, &*it);
+    }
+    auto append_copy = [&](kv_node const *node) {
+        kv_entry *entry = clones[slot_of(node->entry)].second;
+        kv_node *copy = node_traits::allocate(allocator, 1);
+        try {
+            node_traits::construct(allocator, copy, entry, node->value);
+        } catch (...) {
+            node_traits::deallocate(allocator, copy, 1);
+            throw;
+        }
+        append(copy);
+    };
+    if (overlay == nullptr) {
+        for (kv_node *node = other.head; node != nullptr; node = node->next) {
+            append_copy(node);
+        }
+        return;
+    }
+    for (kv_node *node = overlay->head; node != nullptr; node = node->next) {
+        if (!overlay->is_gone(node)) {
+            append_copy(node);
+        }
+    }
+    for (auto const &element : overlay->back) {
+        append_copy(element.node);
+    }
 }
 
-template <typename K, typename V>
-void kvfifo<K, V>::push(K const &k, V const &v) {
-    auto copy = is_copy_needed() ? create_copy() : *this;
-    swap(copy);
+// The node is allocated before the key and the value are touched, so that
+// running out of memory leaves the arguments passed by rvalue intact.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename Key, typename... Args>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::emplace_back(
+        Key &&k, Args &&...args) {
+    kv_node *node = node_traits::allocate(allocator, 1);
+    typename kv_map::iterator it;
+    bool key_inserted;
     try {
-        auto [key_it, key_inserted] = keys->insert(k);
+        std::tie(it, key_inserted) = index.try_emplace(std::forward<Key>(k));
         try {
-            queue->emplace_back(key_it, v);
-            try {
-                auto [it, key_created] = iters->try_emplace(
-                        k, std::list<typename kv_queue::iterator>());
-                try {
-                    it->second.push_back(--queue->end());
-                } catch (...) {
-                    if (key_created) {
-                        iters->erase(it);
-                    }
-                    throw;
-                }
-            } catch (...) {
-                queue->pop_back();
-                throw;
-            }
+            node_traits::construct(allocator, node, &*it,
+                                   std::forward<Args>(args)...);
         } catch (...) {
             if (key_inserted) {
-                keys->erase(key_it);
+                index.erase(it);
             }
             throw;
         }
     } catch (...) {
-        swap(copy);
+        node_traits::deallocate(allocator, node, 1);
         throw;
     }
-    modifiable_from_outside = false;
+    if (key_inserted) {
+        view_valid.store(false, std::memory_order_relaxed);
+    }
+    append(node);
 }
 
-template <typename K, typename V>
-void kvfifo<K, V>::pop() {
-    if (queue->empty()) {
-        throw std::invalid_argument("Queue is empty!");
+// Sets the entry of each pending element, inserting the keys not in the
+// index yet into it and into inserted. A sorted index groups the elements by
+// sorting them, an unsorted one by hashing them with its own hash and
+// equality, so it needs no operator< and stays linear.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename Batch>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::find_entries(
+        Batch &batch, kv_inserted &inserted) {
+    using pending = typename Batch::value_type;
+    auto key_of = [](pending const &p) -> K const & {
+        return std::get<0>(*p.element);
+    };
+    // The key is moved in if the range gives rvalues.
+    auto insert = [&](pending const &p, typename kv_map::iterator hint) {
+        size_t keys_before = index.size();
+        auto it = index.try_emplace(hint, std::get<0>(*p.element));
+        if (index.size() != keys_before) {
+            inserted.push_back(it);
+        }
+        return it;
+    };
+
+    if constexpr (Index::sorted) {
+        using order_allocator = rebind_alloc<pending *>;
+        std::vector<pending *, order_allocator> by_key(
+                (order_allocator(get_allocator())));
+        by_key.reserve(batch.size());
+        for (auto &p : batch) {
+            by_key.push_back(&p);
+        }
+        std::stable_sort(by_key.begin(), by_key.end(),
+                         [&](pending const *a, pending const *b) {
+                             return key_of(*a) < key_of(*b);
+                         });
+        size_t keys = 1;
+        for (size_t i = 1; i < by_key.size(); ++i) {
+            keys += key_of(*by_key[i - 1]) < key_of(*by_key[i]);
+        }
+        inserted.reserve(keys);
+        // The next key usually belongs just before the record after the
+        // previous one, which the hint makes cheap.
+        auto hint = index.end();
+        for (size_t i = 0; i < by_key.size();) {
+            size_t group_end = i + 1;
+            while (group_end < by_key.size()
+                   && !(key_of(*by_key[i]) < key_of(*by_key[group_end]))) {
+                ++group_end;
+            }
+            auto it = insert(*by_key[i], hint);
+            hint = std::next(it);
+            for (; i < group_end; ++i) {
+                by_key[i]->entry = &*it;
+            }
+        }
+    } else {
+        // An open addressing table of the first element of each key, with
+        // room for twice the batch: one allocation, and short probes. The
+        // hash is mixed, as std::hash may be the identity.
+        using slot_allocator = rebind_alloc<pending *>;
+        auto hash = index.hash_function();
+        auto equal = index.key_eq();
+        int shift = std::numeric_limits<size_t>::digits
+                    - std::bit_width(2 * batch.size() - 1);
+        std::vector<pending *, slot_allocator> slots(
+                size_t(1) << (std::numeric_limits<size_t>::digits - shift),
+                nullptr, slot_allocator(get_allocator()));
+        size_t mask = slots.size() - 1;
+        size_t keys = 0;
+        for (auto &p : batch) {
+            size_t i = size_t(hash(key_of(p)) * 0x9e3779b97f4a7c15u) >> shift;
+            while (slots[i] != nullptr
+                   && !equal(key_of(*slots[i]), key_of(p))) {
+                i = (i + 1) & mask;
+            }
+            if (slots[i] == nullptr) {
+                slots[i] = &p;
+                ++keys;
+            }
+            p.first_same = slots[i];
+        }
+        inserted.reserve(keys);
+        // No rehash may invalidate the iterators in inserted.
+        index.reserve(index.size() + keys);
+        // The keys are not hashed again once the first ones may be moved
+        // from.
+        for (auto &p : batch) {
+            if (p.first_same == &p) {
+                p.entry = &*insert(p, index.end());
+            } else {
+                p.entry = p.first_same->entry;
+            }
+        }
     }
-    pop(*queue->front().first);
 }
 
-template <typename K, typename V>
-void kvfifo<K, V>::pop(K const &k) {
-    auto it = iters->find(k);
-    if (it == iters->end()) {
-        throw std::invalid_argument("No such key in the queue!");
-    }
-    if (is_copy_needed()) {
-        auto copy = create_copy();
-        it = copy.iters->find(k);
-        swap(copy);
+// Every node is made, and every key found or inserted, before anything is
+// linked, so undoing a throw only has to free them. The elements are grouped
+// by key to find the keys, each one once, and then linked in range order.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename It>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::append_range(It first,
+                                                                  It last) {
+    struct pending {
+        It element;
+        kv_entry *entry;
+        kv_node *node;
+        // The first element of the range with the same key, for an
+        // unsorted index.
+        pending *first_same;
+    };
+    using pending_allocator = rebind_alloc<pending>;
+
+    std::vector<pending, pending_allocator> batch(
+            (pending_allocator(get_allocator())));
+    batch.reserve(size_t(std::distance(first, last)));
+    for (It it = first; it != last; ++it) {
+        batch.push_back({it, nullptr, nullptr, nullptr});
     }
-    auto key_it = it->second.front()->first;
-    queue->erase(it->second.front());
-    it->second.pop_front();
-    if (it->second.empty()) {
-        iters->erase(it);
-        keys->erase(key_it);
+    if (batch.empty()) {
+        return;
     }
-    modifiable_from_outside = false;
-}
-
-template <typename K, typename V>
-void kvfifo<K, V>::move_to_back(K const &k) {
-    auto it = iters->find(k);
-    if (it == iters->end()) {
-        throw std::invalid_argument("No such key in the queue!");
+    kv_inserted inserted(
+            (typename kv_inserted::allocator_type(get_allocator())));
+    size_t made = 0;
+    try {
+        find_entries(batch, inserted);
+        for (; made < batch.size(); ++made) {
+            pending &p = batch[made];
+            p.node = node_traits::allocate(allocator, 1);
+            try {
+                node_traits::construct(allocator, p.node, p.entry,
+                                       std::get<1>(*p.element));
+            } catch (...) {
+                node_traits::deallocate(allocator, p.node, 1);
+                throw;
+            }
+        }
+    } catch (...) {
+        for (size_t i = 0; i < made; ++i) {
+            destroy_node(batch[i].node);
+        }
+        for (auto it : inserted) {
+            index.erase(it);
+        }
+        throw;
     }
-    if (is_copy_needed()) {
-        auto copy = create_copy();
-        it = copy.iters->find(k);
-        swap(copy);
+    if (!inserted.empty()) {
+        view_valid.store(false, std::memory_order_relaxed);
     }
-    for (auto const &i : it->second) {
-        queue->splice(queue->end(), *queue, i);
+    for (auto &p : batch) {
+        append(p.node);
     }
-    modifiable_from_outside = false;
 }
 
-template <typename K, typename V>
-std::pair<K const &, V &> kvfifo<K, V>::front() {
-    if (queue->empty()) {
-        throw std::invalid_argument("Queue is empty!");
-    }
-    copy_if_needed();
-    modifiable_from_outside = true;
-    return {*queue->front().first, queue->front().second};
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::erase_first(
+        kv_chain &chain) noexcept {
+    kv_node *node = chain.head;
+    chain.head = node->next_same;
+    (chain.head != nullptr ? chain.head->prev_same : chain.tail) = nullptr;
+    --chain.count;
+    unlink(node, node);
+    destroy_node(node);
+    --size;
 }
 
-template <typename K, typename V>
-std::pair<K const &, V const &> kvfifo<K, V>::front() const {
-    if (queue->empty()) {
-        throw std::invalid_argument("Queue is empty!");
+// The record of the first element already is at hand, so the index is only
+// searched when the key is about to disappear.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::pop_front() {
+    kv_entry *entry = head->entry;
+    if (entry->second.count > 1) {
+        erase_first(entry->second);
+    } else {
+        pop_first(index.find(entry->first));
     }
-    return {*queue->front().first, queue->front().second};
 }
 
-template <typename K, typename V>
-std::pair<K const &, V &> kvfifo<K, V>::back() {
-    if (queue->empty()) {
-        throw std::invalid_argument("Queue is empty!");
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename OutIt>
+OutIt kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::pop_front_n(size_t n,
+                                                                  OutIt out) {
+    for (; n > 0 && head != nullptr; --n) {
+        *out = std::pair<K, V>(head->entry->first, std::move(head->value));
+        ++out;
+        pop_front();
     }
-    copy_if_needed();
-    modifiable_from_outside = true;
-    return {*queue->back().first, queue->back().second};
+    return out;
 }
 
-template <typename K, typename V>
-std::pair<K const &, V const &> kvfifo<K, V>::back() const {
-    if (queue->empty()) {
-        throw std::invalid_argument("Queue is empty!");
+// Removes the first element with the key it points at, and the key itself
+// if that was its last element.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::pop_first(
+        typename kv_map::iterator it) noexcept {
+    erase_first(it->second);
+    if (it->second.count == 0) {
+        index.erase(it);
+        view_valid.store(false, std::memory_order_relaxed);
     }
-    return {*queue->back().first, queue->back().second};
 }
 
-template <typename K, typename V>
-std::pair<K const &, V &> kvfifo<K, V>::first(K const &key) {
-    auto it = iters->find(key);
-    if (it == iters->end()) {
-        throw std::invalid_argument("No such key in the queue!");
-    }
-    if (is_copy_needed()) {
-        auto copy = create_copy();
-        it = copy.iters->find(key);
-        swap(copy);
+// Hands each element with the key to take before unlinking it. The record
+// goes with the last one.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename Take>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::pop_all(
+        typename kv_map::iterator it, Take take) {
+    kv_chain &chain = it->second;
+    while (chain.count > 1) {
+        take(std::move(chain.head->value));
+        erase_first(chain);
     }
-    modifiable_from_outside = true;
-    return {*it->second.front()->first, it->second.front()->second};
+    take(std::move(chain.head->value));
+    pop_first(it);
 }
 
-template <typename K, typename V>
-std::pair<K const &, V const &> kvfifo<K, V>::first(K const &key) const {
-    auto it = iters->find(key);
-    if (it == iters->end()) {
-        throw std::invalid_argument("No such key in the queue!");
+// Walks the elements with the key and moves each run of them that is
+// adjacent in the queue as one block.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::move_to_back(
+        kv_chain const &chain) noexcept {
+    kv_node *first = chain.head;
+    while (first != nullptr) {
+        kv_node *last = first;
+        while (last->next_same != nullptr && last->next_same == last->next) {
+            last = last->next;
+        }
+        kv_node *next_run = last->next_same;
+        unlink(first, last);
+        link_back(first, last);
+        first = next_run;
     }
-    return {*it->second.front()->first, it->second.front()->second};
 }
 
-template <typename K, typename V>
-std::pair<K const &, V &> kvfifo<K, V>::last(K const &key) {
-    auto it = iters->find(key);
-    if (it == iters->end()) {
-        throw std::invalid_argument("No such key in the queue!");
+// Whether the elements with the key already are the last ones in the queue,
+// which makes move_to_back a no-op.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::is_at_back(
+        kv_chain const &chain) const noexcept {
+    if (chain.tail != tail) {
+        return false;
     }
-    if (is_copy_needed()) {
-        auto copy = create_copy();
-        it = copy.iters->find(key);
-        swap(copy);
+    for (kv_node *node = chain.tail; node->prev_same != nullptr;
+         node = node->prev_same) {
+        if (node->prev_same != node->prev) {
+            return false;
+        }
     }
-    modifiable_from_outside = true;
-    return {*it->second.back()->first, it->second.back()->second};
+    return true;
 }
 
-template <typename K, typename V>
-std::pair<K const &, V const &> kvfifo<K, V>::last(K const &key) const {
-    auto it = iters->find(key);
-    if (it == iters->end()) {
-        throw std::invalid_argument("No such key in the queue!");
+// Walks the elements with the key from the last one and moves each run of
+// them that is adjacent in the queue to the front as one block, so that the
+// first run ends up first.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::move_to_front(
+        kv_chain const &chain) noexcept {
+    kv_node *last = chain.tail;
+    while (last != nullptr) {
+        kv_node *first = last;
+        while (first->prev_same != nullptr
+               && first->prev_same == first->prev) {
+            first = first->prev;
+        }
+        kv_node *previous_run = first->prev_same;
+        unlink(first, last);
+        link_front(first, last);
+        last = previous_run;
     }
-    return {*it->second.back()->first, it->second.back()->second};
 }
 
-template <typename K, typename V>
-size_t kvfifo<K, V>::size() const noexcept {
-    return queue->size();
+// Whether the elements with the key already are the first ones in the queue,
+// which makes move_to_front a no-op.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::is_at_front(
+        kv_chain const &chain) const noexcept {
+    if (chain.head != head) {
+        return false;
+    }
+    for (kv_node *node = chain.head; node->next_same != nullptr;
+         node = node->next_same) {
+        if (node->next_same != node->next) {
+            return false;
+        }
+    }
+    return true;
 }
 
-template <typename K, typename V>
-size_t kvfifo<K, V>::count(K const &k) const {
-    auto it = iters->find(k);
-    return it == iters->end() ? 0 : it->second.size();
-}
+// Applies the changes of an overlay, made when the state was shared, once it
+// is not. The gone elements are popped key by key first, which keeps the
+// contents of the queue if the index throws; the elements in back are then
+// linked at the back in their order, taking over the nodes of the overlay.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::merge(
+        kv_overlay &overlay) {
+    auto &keys = overlay.keys;
+    for (auto it = keys.begin(); it != keys.end();) {
+        // The state belongs to this queue alone by now.
+        auto &entry = const_cast<kv_entry &>(*it->first);
+        auto &d = it->second;
+        bool key_erased = false;
+        while (d.removed > 0) {
+            kv_node *node = entry.second.head;
+            if (entry.second.count == 1 && d.appended == 0) {
+                pop_first(index.find(entry.first));
+                --overlay.dead_keys;
+                key_erased = true;
+            } else {
+                erase_first(entry.second);
+            }
+            overlay.removed_after_head.erase(node);
+            --d.removed;
+            --overlay.removed;
+        }
+        if (key_erased || (d.appended == 0 && !d.moved)) {
+            it = keys.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto const &element : overlay.back) {
+        if (element.own) {
+            append(element.node);
+        } else {
+            unlink(element.node, element.node);
+            link_back(element.node, element.node);
+        }
+    }
+    overlay.back.clear();
+    overlay.appended = 0;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::sort_view() const {
+    std::lock_guard<std::mutex> guard(view_lock);
+    if (view_valid.load(std::memory_order_relaxed)) {
+        return;
+    }
+    kv_view sorted((typename kv_view::allocator_type(get_allocator())));
+    sorted.reserve(index.size());
+    for (auto const &entry : index) {
+        sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](kv_entry const *a, kv_entry const *b) {
+                  return a->first < b->first;
+              });
+    view.swap(sorted);
+    view_valid.store(true, std::memory_order_release);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::key_iterator
+kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::keys_begin() const
+        noexcept(Index::sorted) {
+    if constexpr (Index::sorted) {
+        return index.cbegin();
+    } else {
+        if (!view_valid.load(std::memory_order_acquire)) {
+            sort_view();
+        }
+        return view.cbegin();
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::key_iterator
+kvfifo<K, V, Index, Alloc, RefCount>::kv_queue::keys_end() const
+        noexcept(Index::sorted) {
+    if constexpr (Index::sorted) {
+        return index.cend();
+    } else {
+        if (!view_valid.load(std::memory_order_acquire)) {
+            sort_view();
+        }
+        return view.cend();
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::kv_overlay(
+        Alloc const &alloc, kv_node *head)
+    : head(head),
+      keys(typename delta_map::allocator_type(alloc)),
+      removed_after_head(typename node_set::allocator_type(alloc)),
+      back(typename back_list::allocator_type(alloc)),
+      allocator(alloc) {}
+
+// The nodes of the pushed elements are copied, so each overlay owns its own.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::kv_overlay(
+        kv_overlay const &other)
+    : head(other.head),
+      removed(other.removed),
+      appended(other.appended),
+      changes(other.changes),
+      moved_keys(other.moved_keys),
+      dead_keys(other.dead_keys),
+      keys(other.keys),
+      removed_after_head(other.removed_after_head),
+      back(other.back),
+      allocator(other.allocator) {
+    size_t copied = 0;
+    try {
+        for (; copied < back.size(); ++copied) {
+            if (!back[copied].own) {
+                continue;
+            }
+            kv_node const *node = back[copied].node;
+            kv_node *copy = node_traits::allocate(allocator, 1);
+            try {
+                node_traits::construct(allocator, copy, node->entry,
+                                       node->value);
+            } catch (...) {
+                node_traits::deallocate(allocator, copy, 1);
+                throw;
+            }
+            back[copied].node = copy;
+        }
+    } catch (...) {
+        for (size_t i = 0; i < copied; ++i) {
+            if (back[i].own) {
+                destroy_node(back[i].node);
+            }
+        }
+        throw;
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::~kv_overlay() noexcept {
+    for (auto const &element : back) {
+        if (element.own) {
+            destroy_node(element.node);
+        }
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::destroy_node(
+        kv_node *node) noexcept {
+    node_traits::destroy(allocator, node);
+    node_traits::deallocate(allocator, node, 1);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::key_delta &
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::delta(
+        kv_entry const &entry) {
+    return keys.try_emplace(&entry, key_delta{0, entry.second.head})
+            .first->second;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::is_gone(
+        kv_node const *node) const noexcept {
+    if (!removed_after_head.empty() && removed_after_head.count(node) != 0) {
+        return true;
+    }
+    if (moved_keys == 0) {
+        return false;
+    }
+    key_delta const *d = find(*node->entry);
+    return d != nullptr && d->moved;
+}
+
+// Moves head past the elements that are gone or in back, forgetting the gone
+// ones it passes.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::skip_gone() noexcept {
+    while (head != nullptr && is_gone(head)) {
+        removed_after_head.erase(head);
+        head = head->next;
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+size_t kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::count(
+        kv_entry const &entry) const noexcept {
+    key_delta const *d = find(entry);
+    if (d == nullptr) {
+        return entry.second.count;
+    }
+    return entry.second.count - d->removed + d->appended;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::front() const noexcept {
+    return head != nullptr ? head : back.front().node;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::back_node(
+        kv_queue const &state) const noexcept {
+    if (!back.empty()) {
+        return back.back().node;
+    }
+    kv_node *node = state.tail;
+    while (is_gone(node)) {
+        node = node->prev;
+    }
+    return node;
+}
+
+// The pushed elements of a key come after all of its elements in the state.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::first(
+        kv_entry const &entry) const noexcept {
+    key_delta const *d = find(entry);
+    if (d == nullptr) {
+        return entry.second.head;
+    }
+    if (d->first_left != nullptr) {
+        return d->first_left;
+    }
+    auto it = std::find_if(back.begin(), back.end(),
+                           [&](back_element const &element) {
+                               return element.node->entry == &entry;
+                           });
+    return it->node;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::last(
+        kv_entry const &entry) const noexcept {
+    key_delta const *d = find(entry);
+    if (d == nullptr || d->appended == 0) {
+        return entry.second.tail;
+    }
+    auto it = std::find_if(back.rbegin(), back.rend(),
+                           [&](back_element const &element) {
+                               return element.node->entry == &entry;
+                           });
+    return it->node;
+}
+
+// Removes the first element of a key that has one.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::pop_first(
+        kv_entry const &entry) {
+    key_delta &d = delta(entry);
+    auto in_back = [&](kv_node const *node) {
+        return std::find_if(back.begin(), back.end(),
+                            [&](back_element const &element) {
+                                return element.node == node;
+                            });
+    };
+    if (kv_node *node = d.first_left) {
+        if (d.moved) {
+            back.erase(in_back(node));
+            ++changes;
+        } else if (node != head) {
+            removed_after_head.insert(node);
+            ++changes;
+        } else {
+            head = node->next;
+        }
+        d.first_left = node->next_same;
+        ++d.removed;
+        ++removed;
+        skip_gone();
+    } else {
+        auto it = in_back(first(entry));
+        kv_node *own = it->node;
+        back.erase(it);
+        destroy_node(own);
+        --d.appended;
+        --appended;
+    }
+    if (d.removed == entry.second.count && d.appended == 0) {
+        ++dead_keys;
+    }
+}
+
+// The node is made before anything changes, and back has room for it.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename... Args>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::emplace_back(
+        kv_entry *entry, Args &&...args) {
+    key_delta &d = delta(*entry);
+    back.reserve(back.size() + 1);
+    kv_node *node = node_traits::allocate(allocator, 1);
+    try {
+        node_traits::construct(allocator, node, entry,
+                               std::forward<Args>(args)...);
+    } catch (...) {
+        node_traits::deallocate(allocator, node, 1);
+        throw;
+    }
+    if (d.removed == entry->second.count && d.appended == 0) {
+        --dead_keys;
+    }
+    back.push_back(back_element{node, true});
+    ++d.appended;
+    ++appended;
+    ++changes;
+}
+
+// Gathers the elements of the key at the end of back, in their order: those
+// of the state first, then the pushed ones.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::move_to_back(
+        kv_entry const &entry) {
+    key_delta &d = delta(entry);
+    size_t left = entry.second.count - d.removed;
+    back.reserve(back.size() + left);
+    auto others_end = std::stable_partition(
+            back.begin(), back.end(), [&](back_element const &element) {
+                return element.node->entry != &entry;
+            });
+    changes += back.end() - others_end;
+    if (!d.moved) {
+        for (kv_node *node = d.first_left; node != nullptr;
+             node = node->next_same) {
+            others_end = back.insert(others_end, back_element{node, false});
+            ++others_end;
+        }
+        changes += left;
+        d.moved = true;
+        ++moved_keys;
+        skip_gone();
+    }
+}
+
+// Makes move_to_back of the keys of the range throw nothing: their deltas
+// are made, and back has room for all their elements.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename It>
+void kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay::prepare_moves(
+        It first, It last) {
+    size_t left = 0;
+    for (; first != last; ++first) {
+        kv_entry const &entry = **first;
+        left += entry.second.count - delta(entry).removed;
+    }
+    back.reserve(back.size() + left);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kvfifo()
+    : queue(nullptr),
+      overlay(nullptr),
+      modifiable_from_outside(false) {}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kvfifo(Alloc const &alloc)
+    : queue(nullptr),
+      overlay(nullptr),
+      modifiable_from_outside(false) {
+    if constexpr (!std::allocator_traits<Alloc>::is_always_equal::value) {
+        queue = make_queue(alloc);
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kvfifo(kvfifo const &other)
+    : queue(nullptr),
+      overlay(nullptr),
+      modifiable_from_outside(false) {
+    if (other.modifiable_from_outside) {
+        counted_copy(other, kvfifo_stats::copy_constructor).swap(*this);
+    } else if (other.queue != nullptr) {
+        if (other.overlay != nullptr) {
+            overlay = make_overlay(other.get_allocator(), *other.overlay);
+        }
+        queue = other.queue;
+        queue->refs.acquire();
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::kvfifo(kvfifo &&other) noexcept
+    : queue(std::exchange(other.queue, nullptr)),
+      overlay(std::exchange(other.overlay, nullptr)),
+      modifiable_from_outside(
+              std::exchange(other.modifiable_from_outside, false)) {}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::~kvfifo() noexcept {
+    if (overlay != nullptr) {
+        destroy_overlay(overlay, get_allocator());
+    }
+    release(queue);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>&
+kvfifo<K, V, Index, Alloc, RefCount>::operator=(kvfifo other) {
+    swap(other);
+    return *this;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_queue *
+kvfifo<K, V, Index, Alloc, RefCount>::make_queue(Alloc const &alloc) {
+    using queue_allocator = rebind_alloc<kv_queue>;
+    using queue_traits = std::allocator_traits<queue_allocator>;
+    queue_allocator allocator(alloc);
+    kv_queue *queue = queue_traits::allocate(allocator, 1);
+    try {
+        queue_traits::construct(allocator, queue, alloc);
+    } catch (...) {
+        queue_traits::deallocate(allocator, queue, 1);
+        throw;
+    }
+    return queue;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::release(kv_queue *queue) noexcept {
+    if (queue == nullptr || !queue->refs.release()) {
+        return;
+    }
+    using queue_allocator = rebind_alloc<kv_queue>;
+    using queue_traits = std::allocator_traits<queue_allocator>;
+    queue_allocator allocator(queue->get_allocator());
+    queue_traits::destroy(allocator, queue);
+    queue_traits::deallocate(allocator, queue, 1);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename... Args>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay *
+kvfifo<K, V, Index, Alloc, RefCount>::make_overlay(Alloc const &alloc,
+                                                  Args &&...args) {
+    using overlay_allocator = rebind_alloc<kv_overlay>;
+    using overlay_traits = std::allocator_traits<overlay_allocator>;
+    overlay_allocator allocator(alloc);
+    kv_overlay *overlay = overlay_traits::allocate(allocator, 1);
+    try {
+        overlay_traits::construct(allocator, overlay,
+                                 std::forward<Args>(args)...);
+    } catch (...) {
+        overlay_traits::deallocate(allocator, overlay, 1);
+        throw;
+    }
+    return overlay;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::destroy_overlay(
+        kv_overlay *overlay, Alloc const &alloc) noexcept {
+    using overlay_allocator = rebind_alloc<kv_overlay>;
+    using overlay_traits = std::allocator_traits<overlay_allocator>;
+    overlay_allocator allocator(alloc);
+    overlay_traits::destroy(allocator, overlay);
+    overlay_traits::deallocate(allocator, overlay, 1);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::is_copy_needed() const noexcept {
+    return queue != nullptr && queue->refs.is_shared();
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::copy_if_needed(
+        kvfifo_stats::site site) {
+    if (is_copy_needed()) {
+        counted_copy(*this, site).swap(*this);
+    } else {
+        settle();
+    }
+}
+
+// Also gives a queue without shared state one of its own. The copy has no
+// overlay: it is made as seen through the overlay.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::create_copy() const {
+    kvfifo copy;
+    copy.queue = make_queue(get_allocator());
+    if (queue != nullptr) {
+        copy.queue->assign(*queue, overlay);
+    }
+    return copy;
+}
+
+// create_copy of from, made for this queue at the given site.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>
+kvfifo<K, V, Index, Alloc, RefCount>::counted_copy(
+        kvfifo const &from, [[maybe_unused]] kvfifo_stats::site site) {
+#ifdef KVFIFO_STATS
+    using std::chrono::steady_clock;
+    auto start = steady_clock::now();
+    kvfifo copy = from.create_copy();
+    std::chrono::nanoseconds elapsed = steady_clock::now() - start;
+    auto ns = std::uint64_t(elapsed.count());
+    std::uint64_t elements = copy.queue->size;
+    std::uint64_t keys = copy.queue->index.size();
+    std::uint64_t bytes = elements * sizeof(kv_node) + keys * sizeof(kv_entry);
+
+    ++detach_stats.detaches[site];
+    detach_stats.elements_copied += elements;
+    detach_stats.keys_copied += keys;
+    detach_stats.bytes_copied += bytes;
+    detach_stats.copy_ns += ns;
+
+    auto &global = kvfifo_detail::stats;
+    global.detaches[site].fetch_add(1, std::memory_order_relaxed);
+    global.elements_copied.fetch_add(elements, std::memory_order_relaxed);
+    global.keys_copied.fetch_add(keys, std::memory_order_relaxed);
+    global.bytes_copied.fetch_add(bytes, std::memory_order_relaxed);
+    global.copy_ns.fetch_add(ns, std::memory_order_relaxed);
+    return copy;
+#else
+    return from.create_copy();
+#endif
+}
+
+// Whether a shared state may take a change of that many elements through the
+// overlay of this queue instead of a copy.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::can_overlay(
+        size_t changes) const noexcept {
+    if (!is_copy_needed()) {
+        return false;
+    }
+    return overlay != nullptr
+                   ? overlay->fits(changes) && !overlay->is_worn(size())
+                   : changes <= kv_overlay::limit;
+}
+
+// Whether a shared state may lose its front element through the overlay of
+// this queue instead of a copy.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::can_pop_front() const noexcept {
+    return is_copy_needed()
+           && (overlay == nullptr || !overlay->is_worn(size()));
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_overlay &
+kvfifo<K, V, Index, Alloc, RefCount>::get_overlay() {
+    if (overlay == nullptr) {
+        overlay = make_overlay(get_allocator(), get_allocator(), queue->head);
+    }
+    return *overlay;
+}
+
+// Once the state is no longer shared, applies the changes of the overlay for
+// real. If that throws, the queue keeps its contents.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::settle() {
+    if (overlay == nullptr) {
+        return;
+    }
+    queue->merge(*overlay);
+    destroy_overlay(std::exchange(overlay, nullptr), get_allocator());
+}
 
-template <typename K, typename V>
-bool kvfifo<K, V>::empty() const noexcept {
-    return queue->empty();
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::swap(kvfifo &other) noexcept {
+    std::swap(other.queue, queue);
+    std::swap(other.overlay, overlay);
+    std::swap(other.modifiable_from_outside, modifiable_from_outside);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::check_not_empty() const {
+    if (empty()) {
+        throw std::invalid_argument("Queue is empty!");
+    }
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_map::iterator
+kvfifo<K, V, Index, Alloc, RefCount>::find_key(K const &k) const {
+    if (queue != nullptr) {
+        auto it = queue->index.find(k);
+        if (it != queue->index.end()
+            && (overlay == nullptr || !overlay->is_dead(*it))) {
+            return it;
+        }
+    }
+    throw std::invalid_argument("No such key in the queue!");
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::front_node() const noexcept {
+    return overlay != nullptr ? overlay->front() : queue->head;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::back_node() const noexcept {
+    return overlay != nullptr ? overlay->back_node(*queue) : queue->tail;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::first_node(
+        kv_entry const &entry) const noexcept {
+    return overlay != nullptr ? overlay->first(entry) : entry.second.head;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_node *
+kvfifo<K, V, Index, Alloc, RefCount>::last_node(
+        kv_entry const &entry) const noexcept {
+    return overlay != nullptr ? overlay->last(entry) : entry.second.tail;
+}
+
+// find_key in the state of this queue alone, which it detaches if needed.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_map::iterator
+kvfifo<K, V, Index, Alloc, RefCount>::find_own_key(
+        K const &k, kvfifo_stats::site site) {
+    return own_key(find_key(k), site);
+}
+
+// The same key as it, found by find_key, in the state of this queue alone.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::kv_map::iterator
+kvfifo<K, V, Index, Alloc, RefCount>::own_key(typename kv_map::iterator it,
+                                              kvfifo_stats::site site) {
+    if (is_copy_needed()) {
+        auto copy = counted_copy(*this, site);
+        it = copy.queue->index.find(it->first);
+        swap(copy);
+    } else {
+        settle();
+    }
+    return it;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename Key, typename... Args>
+void kvfifo<K, V, Index, Alloc, RefCount>::emplace_key(Key &&k,
+                                                      Args &&...args) {
+    if (can_overlay(1)) {
+        auto it = queue->index.find(k);
+        if (it != queue->index.end()) {
+            get_overlay().emplace_back(&*it, std::forward<Args>(args)...);
+            modifiable_from_outside = false;
+            return;
+        }
+    }
+    if (queue == nullptr || is_copy_needed()) {
+        auto copy = queue == nullptr ? create_copy()
+                                     : counted_copy(*this, kvfifo_stats::push);
+        copy.queue->emplace_back(std::forward<Key>(k),
+                                 std::forward<Args>(args)...);
+        swap(copy);
+    } else {
+        settle();
+        queue->emplace_back(std::forward<Key>(k), std::forward<Args>(args)...);
+    }
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::push(K const &k, V const &v) {
+    emplace_key(k, v);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::push(K const &k, V &&v) {
+    emplace_key(k, std::move(v));
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::push(K &&k, V const &v) {
+    emplace_key(std::move(k), v);
 }
 
-template <typename K, typename V>
-void kvfifo<K, V>::clear() {
-    kvfifo<K, V>().swap(*this);
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::push(K &&k, V &&v) {
+    emplace_key(std::move(k), std::move(v));
 }
 
-template <typename K, typename V>
-typename kvfifo<K, V>::k_iterator kvfifo<K, V>::k_begin() const noexcept {
-    return keys->cbegin();
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename... Args>
+void kvfifo<K, V, Index, Alloc, RefCount>::emplace(K const &k,
+                                                  Args &&...args) {
+    emplace_key(k, std::forward<Args>(args)...);
 }
 
-template <typename K, typename V>
-typename kvfifo<K, V>::k_iterator kvfifo<K, V>::k_end() const noexcept {
-    return keys->cend();
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename... Args>
+void kvfifo<K, V, Index, Alloc, RefCount>::emplace(K &&k, Args &&...args) {
+    emplace_key(std::move(k), std::forward<Args>(args)...);
 }
 
+// A batch is too big for the overlay, so a shared state is copied once for
+// the whole of it.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename It>
+void kvfifo<K, V, Index, Alloc, RefCount>::push_range(It first, It last) {
+    static_assert(std::is_base_of_v<
+                          std::forward_iterator_tag,
+                          typename std::iterator_traits<It>::iterator_category>,
+                  "push_range needs a forward iterator");
+    if (first == last) {
+        return;
+    }
+    if (queue == nullptr || is_copy_needed()) {
+        auto copy = queue == nullptr ? create_copy()
+                                     : counted_copy(*this, kvfifo_stats::push);
+        copy.queue->append_range(first, last);
+        swap(copy);
+    } else {
+        settle();
+        queue->append_range(first, last);
+    }
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::pop() {
+    check_not_empty();
+    if (can_pop_front()) {
+        get_overlay().pop_first(*front_node()->entry);
+    } else {
+        copy_if_needed(kvfifo_stats::pop);
+        queue->pop_front();
+    }
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::pop(K const &k) {
+    auto it = find_key(k);
+    if (can_overlay(1)) {
+        get_overlay().pop_first(*it);
+    } else {
+        it = own_key(it, kvfifo_stats::pop_key);
+        queue->pop_first(it);
+    }
+    modifiable_from_outside = false;
+}
+
+// Only the last time a key appears in the range counts, as the moves before
+// it are undone by it. The keys are all found, and the state copied if it
+// has to be, before the moves, which throw nothing.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <std::input_iterator It>
+void kvfifo<K, V, Index, Alloc, RefCount>::move_to_back(It first_key,
+                                                        It last_key) {
+    using position = std::pair<kv_entry *, size_t>;
+    std::vector<position, rebind_alloc<position>> found(
+            (rebind_alloc<position>(get_allocator())));
+    for (size_t i = 0; first_key != last_key; ++first_key, ++i) {
+        found.emplace_back(&*find_key(*first_key), i);
+    }
+    if (found.empty()) {
+        return;
+    }
+    std::sort(found.begin(), found.end(),
+              [](position const &a, position const &b) {
+                  std::less<kv_entry *> before;
+                  return before(a.first, b.first)
+                         || (a.first == b.first && a.second < b.second);
+              });
+    auto last_of_each = std::unique(
+            found.rbegin(), found.rend(),
+            [](position const &a, position const &b) {
+                return a.first == b.first;
+            });
+    found.erase(found.begin(), last_of_each.base());
+    std::sort(found.begin(), found.end(),
+              [](position const &a, position const &b) {
+                  return a.second < b.second;
+              });
+    std::vector<kv_entry *, rebind_alloc<kv_entry *>> entries(
+            (rebind_alloc<kv_entry *>(get_allocator())));
+    entries.reserve(found.size());
+    size_t m = 0;
+    for (auto const &[entry, i] : found) {
+        entries.push_back(entry);
+        m += overlay != nullptr ? overlay->count(*entry) : entry->second.count;
+    }
+
+    if (can_overlay(m)) {
+        kv_overlay &o = get_overlay();
+        o.prepare_moves(entries.begin(), entries.end());
+        for (kv_entry *entry : entries) {
+            o.move_to_back(*entry);
+        }
+    } else {
+        if (is_copy_needed()) {
+            auto copy = counted_copy(*this, kvfifo_stats::move_to_back);
+            for (kv_entry *&entry : entries) {
+                entry = &*copy.queue->index.find(entry->first);
+            }
+            swap(copy);
+        } else {
+            settle();
+        }
+        for (kv_entry *entry : entries) {
+            queue->move_to_back(entry->second);
+        }
+    }
+    modifiable_from_outside = false;
+}
+
+// Calls take with each value of the key, as an rvalue if the state is this
+// queue's own and as a const lvalue otherwise, and pops it.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename Take>
+void kvfifo<K, V, Index, Alloc, RefCount>::take_all(K const &k, Take take) {
+    auto it = find_key(k);
+    size_t m = overlay != nullptr ? overlay->count(*it) : it->second.count;
+    if (can_overlay(m)) {
+        for (; m > 0; --m) {
+            take(std::as_const(first_node(*it)->value));
+            get_overlay().pop_first(*it);
+        }
+    } else {
+        it = own_key(it, kvfifo_stats::pop_key);
+        queue->pop_all(it, take);
+    }
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::pop_all(K const &k) {
+    take_all(k, [](V const &) noexcept {});
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename OutIt>
+OutIt kvfifo<K, V, Index, Alloc, RefCount>::pop_all(K const &k, OutIt out) {
+    take_all(k, [&out](auto &&value) {
+        *out = std::forward<decltype(value)>(value);
+        ++out;
+    });
+    return out;
+}
+
+// A shared state keeps its values, so they are copied out and the elements
+// popped through the overlay, until it is worn and the rest is copied. A
+// queue that this empties lets go of the state, so that another copy may
+// have it to itself again, unless an empty queue needs a state of its own to
+// remember its allocator.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename OutIt>
+OutIt kvfifo<K, V, Index, Alloc, RefCount>::pop_n(size_t n, OutIt out) {
+    if (empty() || n == 0) {
+        return out;
+    }
+    for (; n > 0 && !empty() && can_pop_front(); --n) {
+        kv_node *node = front_node();
+        *out = std::pair<K, V>(node->entry->first, node->value);
+        ++out;
+        get_overlay().pop_first(*node->entry);
+    }
+    if (empty()) {
+        if constexpr (std::allocator_traits<Alloc>::is_always_equal::value) {
+            if (is_copy_needed()) {
+                kvfifo().swap(*this);
+            }
+        }
+    } else if (n > 0) {
+        copy_if_needed(kvfifo_stats::pop);
+        out = queue->pop_front_n(n, out);
+    }
+    modifiable_from_outside = false;
+    return out;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename OutIt>
+OutIt kvfifo<K, V, Index, Alloc, RefCount>::drain(OutIt out) {
+    return pop_n(size(), out);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::move_to_back(K const &k) {
+    auto it = find_key(k);
+    if (overlay == nullptr && queue->is_at_back(it->second)) {
+        modifiable_from_outside = false;
+        return;
+    }
+    size_t m = overlay != nullptr ? overlay->count(*it) : it->second.count;
+    if (can_overlay(m)) {
+        get_overlay().move_to_back(*it);
+    } else {
+        it = own_key(it, kvfifo_stats::move_to_back);
+        queue->move_to_back(it->second);
+    }
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::move_to_front(K const &k) {
+    auto it = find_key(k);
+    if (overlay == nullptr && queue->is_at_front(it->second)) {
+        modifiable_from_outside = false;
+        return;
+    }
+    it = own_key(it, kvfifo_stats::move_to_front);
+    queue->move_to_front(it->second);
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V &>
+kvfifo<K, V, Index, Alloc, RefCount>::front() {
+    check_not_empty();
+    copy_if_needed(kvfifo_stats::front);
+    modifiable_from_outside = true;
+    return {queue->head->entry->first, queue->head->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V const &>
+kvfifo<K, V, Index, Alloc, RefCount>::front() const {
+    check_not_empty();
+    kv_node *node = front_node();
+    return {node->entry->first, node->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V &>
+kvfifo<K, V, Index, Alloc, RefCount>::back() {
+    check_not_empty();
+    copy_if_needed(kvfifo_stats::back);
+    modifiable_from_outside = true;
+    return {queue->tail->entry->first, queue->tail->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V const &>
+kvfifo<K, V, Index, Alloc, RefCount>::back() const {
+    check_not_empty();
+    kv_node *node = back_node();
+    return {node->entry->first, node->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V &>
+kvfifo<K, V, Index, Alloc, RefCount>::first(K const &key) {
+    auto it = find_own_key(key, kvfifo_stats::first);
+    modifiable_from_outside = true;
+    return {it->first, it->second.head->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V const &>
+kvfifo<K, V, Index, Alloc, RefCount>::first(K const &key) const {
+    auto it = find_key(key);
+    return {it->first, first_node(*it)->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V &>
+kvfifo<K, V, Index, Alloc, RefCount>::last(K const &key) {
+    auto it = find_own_key(key, kvfifo_stats::last);
+    modifiable_from_outside = true;
+    return {it->first, it->second.tail->value};
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+std::pair<K const &, V const &>
+kvfifo<K, V, Index, Alloc, RefCount>::last(K const &key) const {
+    auto it = find_key(key);
+    return {it->first, last_node(*it)->value};
+}
+
+// A modification like any other, so the references handed out before by the
+// non-const accessors no longer count.
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename F>
+decltype(auto) kvfifo<K, V, Index, Alloc, RefCount>::modify_front(F &&fn) {
+    check_not_empty();
+    copy_if_needed(kvfifo_stats::front);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), queue->head->value);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename F>
+decltype(auto) kvfifo<K, V, Index, Alloc, RefCount>::modify_back(F &&fn) {
+    check_not_empty();
+    copy_if_needed(kvfifo_stats::back);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), queue->tail->value);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename F>
+decltype(auto) kvfifo<K, V, Index, Alloc, RefCount>::modify_first(
+        K const &key, F &&fn) {
+    auto it = find_own_key(key, kvfifo_stats::first);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), it->second.head->value);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+template <typename F>
+decltype(auto) kvfifo<K, V, Index, Alloc, RefCount>::modify_last(
+        K const &key, F &&fn) {
+    auto it = find_own_key(key, kvfifo_stats::last);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), it->second.tail->value);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+size_t kvfifo<K, V, Index, Alloc, RefCount>::size() const noexcept {
+    if (queue == nullptr) {
+        return 0;
+    }
+    if (overlay == nullptr) {
+        return queue->size;
+    }
+    return queue->size - overlay->removed + overlay->appended;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+size_t kvfifo<K, V, Index, Alloc, RefCount>::count(K const &k) const {
+    if (queue == nullptr) {
+        return 0;
+    }
+    auto it = queue->index.find(k);
+    if (it == queue->index.end()) {
+        return 0;
+    }
+    return overlay != nullptr ? overlay->count(*it) : it->second.count;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+bool kvfifo<K, V, Index, Alloc, RefCount>::empty() const noexcept {
+    return size() == 0;
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+void kvfifo<K, V, Index, Alloc, RefCount>::clear() {
+    kvfifo(get_allocator()).swap(*this);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+Alloc kvfifo<K, V, Index, Alloc, RefCount>::get_allocator() const noexcept {
+    return queue == nullptr ? Alloc() : queue->get_allocator();
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::k_iterator
+kvfifo<K, V, Index, Alloc, RefCount>::k_begin() const noexcept(Index::sorted) {
+    if (queue == nullptr) {
+        return k_iterator();
+    }
+    return k_iterator(queue->keys_begin(), queue->keys_end(), overlay);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::k_iterator
+kvfifo<K, V, Index, Alloc, RefCount>::k_end() const noexcept(Index::sorted) {
+    if (queue == nullptr) {
+        return k_iterator();
+    }
+    return k_iterator(queue->keys_end(), queue->keys_end(), overlay);
+}
+
+template <typename K, typename V, typename Index, typename Alloc,
+          typename RefCount>
+typename kvfifo<K, V, Index, Alloc, RefCount>::snapshot_view
+kvfifo<K, V, Index, Alloc, RefCount>::snapshot() const {
+    static_assert(RefCount::atomic,
+                  "A snapshot read in other threads needs atomic_count.");
+    snapshot_view view(*this);
+    if (view.queue.queue != nullptr) {
+        view.queue.queue->keys_begin();
+    }
+    return view;
+}
+
+#undef KVFIFO_HAS_SINGLE_THREADED
+
 #endif  // __KVFIFO_H__
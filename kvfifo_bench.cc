@@ -0,0 +1,488 @@
+#include "concurrent_kvfifo.h"
+#include "kvfifo.h"
+#include "mpsc_kvfifo.h"
+#include "persistent_kvfifo.h"
+#include "sharded_kvfifo.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Every allocation made by the program goes through these, so the number of
+// heap allocations an operation costs can be read off allocations.
+namespace {
+    size_t allocations = 0;
+}
+
+// Kept out of line: once either side is inlined into the containers, GCC
+// pairs malloc or free with the operator on the other side and warns of a
+// mismatch.
+[[gnu::noinline]] void *operator new(size_t size) {
+    ++allocations;
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+    using bench_clock = std::chrono::steady_clock;
+
+    double elapsed_ns(bench_clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(
+                bench_clock::now() - start).count();
+    }
+
+    // Pushes n elements spread over the given number of distinct keys.
+    template <typename Q = kvfifo<int, int>>
+    void bench_push(char const *name, int n, int distinct_keys) {
+        Q q;
+        size_t before = allocations;
+        auto start = bench_clock::now();
+        for (int i = 0; i < n; ++i) {
+            q.push(i % distinct_keys, i);
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.2f allocations/push %8.1f ns/push\n", name,
+                    double(allocations - before) / n, ns / n);
+    }
+
+    // Pushes batches of 10^4 elements, each with push in a loop or with one
+    // push_range.
+    template <typename Q>
+    void bench_batches(char const *name, int n, int distinct_keys,
+                       bool range) {
+        int const batch_size = 10000;
+        std::vector<std::pair<int, int>> batch;
+        for (int i = 0; i < batch_size; ++i) {
+            batch.emplace_back(int((i * 2654435761u) % distinct_keys), i);
+        }
+        Q q;
+        size_t before = allocations;
+        auto start = bench_clock::now();
+        for (int pushed = 0; pushed < n; pushed += batch_size) {
+            if (range) {
+                q.push_range(batch.begin(), batch.end());
+            } else {
+                for (auto const &[k, v] : batch) {
+                    q.push(k, v);
+                }
+            }
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.2f allocations/push %8.1f ns/push\n", name,
+                    double(allocations - before) / n, ns / n);
+    }
+
+    // Builds many queues of the given size, each element with its own key.
+    void bench_small(char const *name, int elements) {
+        int const queues = 100000;
+        size_t before = allocations;
+        auto start = bench_clock::now();
+        for (int i = 0; i < queues; ++i) {
+            kvfifo<int, int> q;
+            for (int j = 0; j < elements; ++j) {
+                q.push(j, j);
+            }
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.2f allocations/queue %8.1f ns/queue\n", name,
+                    double(allocations - before) / queues, ns / queues);
+    }
+
+    // Copies a shared queue into a vector, as kvfifo_example.cc does.
+    template <typename Q>
+    void bench_copy(char const *name) {
+        Q q;
+        for (int i = 0; i < 1000; ++i) {
+            q.push(i, i);
+        }
+        int const copies = 1000000;
+        std::vector<Q> copied;
+        copied.reserve(copies);
+        auto start = bench_clock::now();
+        for (int i = 0; i < copies; ++i) {
+            copied.push_back(q);
+        }
+        copied.clear();
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f ns/copy+destroy, sizeof %zu\n", name,
+                    ns / copies, sizeof(Q));
+    }
+
+    struct big_value {
+        static inline size_t copies = 0;
+
+        std::vector<char> payload;
+
+        explicit big_value(size_t size) : payload(size) {}
+        big_value(big_value const &other) : payload(other.payload) {
+            ++copies;
+        }
+        big_value(big_value &&) noexcept = default;
+    };
+
+    enum class push_kind { copy, move, emplace };
+
+    // Pushes n values of 1 KiB, copied, moved or built in place.
+    void bench_push_value(char const *name, int n, push_kind kind) {
+        kvfifo<int, big_value> q;
+        size_t copies_before = big_value::copies;
+        auto start = bench_clock::now();
+        for (int i = 0; i < n; ++i) {
+            if (kind == push_kind::emplace) {
+                q.emplace(i % 1000, 1024);
+                continue;
+            }
+            big_value v(1024);
+            if (kind == push_kind::copy) {
+                q.push(i % 1000, v);
+            } else {
+                q.push(i % 1000, std::move(v));
+            }
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.2f copies/push %8.1f ns/push\n", name,
+                    double(big_value::copies - copies_before) / n, ns / n);
+    }
+
+    // Changes the front value of a queue of 1000 elements and copies the
+    // queue, as a reader handing the queue on does.
+    void bench_modify(char const *name, bool through_modify) {
+        kvfifo<int, big_value> q;
+        for (int i = 0; i < 1000; ++i) {
+            q.emplace(i, 16);
+        }
+        int const rounds = 1000;
+        size_t copies_before = big_value::copies;
+        auto start = bench_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            if (through_modify) {
+                q.modify_front([](big_value &v) { ++v.payload[0]; });
+            } else {
+                ++q.front().second.payload[0];
+            }
+            auto copy = q;
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.2f copies/round %8.1f ns/round\n", name,
+                    double(big_value::copies - copies_before) / rounds,
+                    ns / rounds);
+    }
+
+    // Times the first pop on a copy of a queue of n elements, which has to
+    // detach the copy from the original. The keys come in scrambled order.
+    void bench_detach(char const *name, int n, int distinct_keys) {
+        kvfifo<int, int> q;
+        for (int i = 0; i < n; ++i) {
+            q.push(int((i * 2654435761u) % n) % distinct_keys, i);
+        }
+        auto copy = q;
+        auto start = bench_clock::now();
+        copy.pop();
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f ms/detach %8.1f ns/element\n", name,
+                    ns / 1e6, ns / n);
+    }
+
+    // Copies a queue of n elements, then pushes and pops one element on the
+    // copy, as a request working on its own fork of a shared queue does.
+    template <typename Q>
+    void bench_fork(char const *name, int n) {
+        Q q;
+        for (int i = 0; i < n; ++i) {
+            q.push(i % 1000, i);
+        }
+        int const forks = 1000;
+        auto start = bench_clock::now();
+        for (int i = 0; i < forks; ++i) {
+            Q fork = q;
+            fork.push(i, i);
+            fork.pop();
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f us/fork\n", name, ns / forks / 1e3);
+    }
+
+    // Copies a queue of n elements with 10 per key, moves one key to the back
+    // and pops another on the copy, then reads it a few times.
+    void bench_tweak(char const *name, int n) {
+        kvfifo<int, int> q;
+        for (int i = 0; i < n; ++i) {
+            q.push(i % (n / 10), i);
+        }
+        int const forks = 1000;
+        long sum = 0;
+        auto start = bench_clock::now();
+        for (int i = 0; i < forks; ++i) {
+            auto fork = q;
+            fork.move_to_back(i);
+            fork.pop(i + 1);
+            auto const &reader = fork;
+            for (int r = 0; r < 100; ++r) {
+                sum += reader.front().second + long(reader.count(r));
+            }
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f us/fork (%ld)\n", name, ns / forks / 1e3,
+                    sum);
+    }
+
+    // Gives each of many consumers a copy of a queue of n elements, from
+    // which it pops a few.
+    void bench_fan_out(char const *name, int n) {
+        kvfifo<int, int> q;
+        for (int i = 0; i < n; ++i) {
+            q.push(i % 1000, i);
+        }
+        int const consumers = 100;
+        int const pops = 10;
+        auto start = bench_clock::now();
+        for (int i = 0; i < consumers; ++i) {
+            auto copy = q;
+            for (int j = 0; j < pops; ++j) {
+                copy.pop();
+            }
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f ns/pop\n", name, ns / (consumers * pops));
+    }
+
+    // Empties a queue of n elements spread over distinct_keys keys with pop().
+    void bench_pop(char const *name, int n, int distinct_keys) {
+        kvfifo<int, int> q;
+        for (int i = 0; i < n; ++i) {
+            q.push(i % distinct_keys, i);
+        }
+        auto start = bench_clock::now();
+        while (!q.empty()) {
+            q.pop();
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f ns/pop\n", name, ns / n);
+    }
+
+    // Takes the elements of a queue of n elements out into a vector, with
+    // front and pop for each, or with pop_n 1000 at a time.
+    void bench_consume(char const *name, int n, int distinct_keys, bool bulk) {
+        kvfifo<int, std::string> q;
+        for (int i = 0; i < n; ++i) {
+            q.push(i % distinct_keys, std::string(32, 'x'));
+        }
+        std::vector<std::pair<int, std::string>> out;
+        out.reserve(n);
+        auto start = bench_clock::now();
+        while (!q.empty()) {
+            if (bulk) {
+                q.pop_n(1000, std::back_inserter(out));
+            } else {
+                auto element = q.front();
+                out.emplace_back(element.first, std::move(element.second));
+                q.pop();
+            }
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f ns/element\n", name, ns / n);
+    }
+
+    // kvfifo behind a single mutex, as threads share one without
+    // concurrent_kvfifo.
+    class locked_kvfifo {
+    public:
+        void push(int k, int v) {
+            std::lock_guard<std::mutex> guard(lock);
+            q.push(k, v);
+        }
+
+        std::pair<int, int> pop() {
+            std::lock_guard<std::mutex> guard(lock);
+            std::pair<int, int> element = std::as_const(q).front();
+            q.pop();
+            return element;
+        }
+
+        std::pair<int, int> pop(int k) {
+            std::lock_guard<std::mutex> guard(lock);
+            int v = std::as_const(q).first(k).second;
+            q.pop(k);
+            return {k, v};
+        }
+
+    private:
+        std::mutex lock;
+        kvfifo<int, int> q;
+    };
+
+    // Each thread pushes elements of its own keys and pops as many, half of
+    // them by key. Another thread may have taken the element a keyed pop
+    // looks for, which then throws.
+    template <typename Q>
+    void bench_threads(char const *name, int threads) {
+        int const ops = 200000;
+        Q q;
+        std::vector<std::thread> workers;
+        auto start = bench_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&q, t] {
+                for (int i = 0; i < ops; ++i) {
+                    int k = t * 1000 + i % 1000;
+                    q.push(k, i);
+                    try {
+                        if (i % 2 == 0) {
+                            q.pop();
+                        } else {
+                            q.pop(k);
+                        }
+                    } catch (std::invalid_argument const &) {
+                    }
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %2d threads %8.2f Mops/s\n", name, threads,
+                    2.0 * ops * threads / ns * 1e3);
+    }
+
+    // Producer threads push elements of their own keys while one consumer
+    // pops them all, by key every other time.
+    template <typename Q>
+    void bench_producers(char const *name, int producers) {
+        int const ops = 200000;
+        Q q;
+        std::vector<std::thread> workers;
+        auto start = bench_clock::now();
+        for (int t = 0; t < producers; ++t) {
+            workers.emplace_back([&q, t] {
+                for (int i = 0; i < ops; ++i) {
+                    q.push(t, i);
+                }
+            });
+        }
+        // A keyed pop that finds no element moves on to the next key.
+        for (int popped = 0, k = 0; popped < ops * producers;) {
+            try {
+                if (popped % 2 == 0) {
+                    q.pop();
+                } else {
+                    q.pop(k);
+                }
+                ++popped;
+            } catch (std::invalid_argument const &) {
+                k = (k + 1) % producers;
+            }
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %2d producers %8.2f Mpushes/s\n", name, producers,
+                    1.0 * ops * producers / ns * 1e3);
+    }
+
+    // Pushes one element for each key, then counts and pops them by key.
+    template <typename Q, typename K>
+    void bench_keyed(char const *name, std::vector<K> const &keys) {
+        Q q;
+        auto start = bench_clock::now();
+        for (auto const &k : keys) {
+            q.push(k, 0);
+        }
+        size_t found = 0;
+        for (auto const &k : keys) {
+            found += q.count(k);
+        }
+        for (auto const &k : keys) {
+            q.pop(k);
+        }
+        double ns = elapsed_ns(start);
+        std::printf("%-28s %8.1f ns/key (found %zu)\n", name,
+                    ns / keys.size(), found);
+    }
+}
+
+int main() {
+    int const n = 1000000;
+    // First, while the heap is fresh; the detach walks the whole queue.
+    bench_detach("detach, 1000 keys", n, 1000);
+    bench_detach("detach, distinct keys", n, n);
+    bench_push("push, distinct keys", n, n);
+    bench_push("push, 1000 keys", n, 1000);
+    bench_push("push, single key", n, 1);
+    using batched = kvfifo<int, int>;
+    using hashed_batched = kvfifo<int, int, kvfifo_policy::hashed_index>;
+    bench_batches<batched>("batches, 1000 keys, push", n, 1000, false);
+    bench_batches<batched>("batches, 1000 keys, range", n, 1000, true);
+    bench_batches<batched>("batches, 10^5 keys, push", n, n / 10, false);
+    bench_batches<batched>("batches, 10^5 keys, range", n, n / 10, true);
+    bench_batches<hashed_batched>("batches, hashed, push", n, n / 10,
+                                  false);
+    bench_batches<hashed_batched>("batches, hashed, range", n, n / 10, true);
+    bench_push_value("push 1 KiB value, copy", n / 10, push_kind::copy);
+    bench_push_value("push 1 KiB value, move", n / 10, push_kind::move);
+    bench_push_value("emplace 1 KiB value", n / 10, push_kind::emplace);
+    bench_push<persistent_kvfifo<int, int>>("push, 1000 keys, persistent",
+                                            n, 1000);
+    bench_modify("front, then copy", false);
+    bench_modify("modify_front, then copy", true);
+    bench_small("small queue, 0 elements", 0);
+    bench_small("small queue, 1 element", 1);
+    bench_small("small queue, 4 elements", 4);
+    bench_fork<kvfifo<int, int>>("fork of 10^5, kvfifo", n / 10);
+    bench_fork<persistent_kvfifo<int, int>>("fork of 10^5, persistent",
+                                            n / 10);
+    bench_fan_out("pop from shared, 10^5", n / 10);
+    bench_tweak("tweak a shared 10^5", n / 10);
+    bench_pop("pop, distinct keys", n, n);
+    bench_pop("pop, 1000 keys", n, 1000);
+    bench_consume("consume, front + pop", n, 1000, false);
+    bench_consume("consume, pop_n", n, 1000, true);
+
+    std::vector<int> int_keys;
+    std::vector<std::string> string_keys;
+    for (int i = 0; i < n; ++i) {
+        int_keys.push_back(int((i * 2654435761u) % n));
+        string_keys.push_back("key-" + std::to_string(int_keys.back()));
+    }
+    using kvfifo_policy::hashed_index;
+    bench_keyed<kvfifo<int, int>>("keyed, int, ordered", int_keys);
+    bench_keyed<kvfifo<int, int, hashed_index>>("keyed, int, hashed", int_keys);
+    bench_keyed<kvfifo<std::string, int>>("keyed, string, ordered",
+                                          string_keys);
+    bench_keyed<kvfifo<std::string, int, hashed_index>>(
+            "keyed, string, hashed", string_keys);
+
+    bench_copy<kvfifo<int, int>>("copy, atomic count");
+    bench_copy<kvfifo<int, int, kvfifo_policy::ordered_index,
+                      std::allocator<std::pair<int const, int>>,
+                      kvfifo_policy::plain_count>>("copy, plain count");
+    // Reference counts stop skipping atomic operations once there are threads.
+    std::thread([] {}).join();
+    bench_copy<kvfifo<int, int>>("copy, atomic count, threads");
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        bench_threads<locked_kvfifo>("kvfifo + mutex", threads);
+        bench_threads<concurrent_kvfifo<int, int>>("concurrent_kvfifo",
+                                                   threads);
+        bench_threads<sharded_kvfifo<int, int>>("sharded_kvfifo, 16 shards",
+                                                threads);
+    }
+    for (int producers : {1, 2, 4, 8}) {
+        bench_producers<locked_kvfifo>("kvfifo + mutex", producers);
+        bench_producers<mpsc_kvfifo<int, int>>("mpsc_kvfifo", producers);
+    }
+}
@@ -3,6 +3,93 @@
 #include <memory>
 #include <vector>
 #include <iterator>
+#include <memory_resource>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+struct counted_key {
+    static inline int copies = 0;
+
+    int id;
+
+    counted_key(int id = 0) : id(id) {}
+    counted_key(counted_key const &other) : id(other.id) { ++copies; }
+    counted_key& operator=(counted_key const &) = default;
+
+    bool operator<(counted_key const &other) const { return id < other.id; }
+};
+
+// Hashable but not ordered, for a hashed_index that never lists its keys.
+struct unordered_key {
+    int id;
+
+    bool operator==(unordered_key const &other) const {
+        return id == other.id;
+    }
+};
+
+template <>
+struct std::hash<unordered_key> {
+    size_t operator()(unordered_key const &key) const noexcept {
+        return std::hash<int>()(key.id);
+    }
+};
+
+// Counts its allocations and fails on memory it did not allocate.
+class counting_resource : public std::pmr::memory_resource {
+public:
+    size_t allocations = 0;
+
+private:
+    std::set<void *> live;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        ++allocations;
+        void *p = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        live.insert(p);
+        return p;
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        assert(live.erase(p) == 1);
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(memory_resource const &other) const noexcept override {
+        return this == &other;
+    }
+};
+
+struct counted_value {
+    static inline int copies = 0;
+    static inline int moves = 0;
+
+    int a, b;
+
+    counted_value(int a, int b) : a(a), b(b) {}
+    counted_value(counted_value const &other) : a(other.a), b(other.b) {
+        ++copies;
+    }
+    counted_value(counted_value &&other) noexcept : a(other.a), b(other.b) {
+        ++moves;
+    }
+};
+
+// Throws from the copy constructor once countdown copies reach zero.
+struct throwing_value {
+    static inline int countdown = -1;
+
+    int a;
+
+    throwing_value(int a) : a(a) {}
+    throwing_value(throwing_value const &other) : a(other.a) {
+        if (--countdown == 0) {
+            throw std::runtime_error("copy");
+        }
+    }
+};
 
 auto f(kvfifo<int, int> q) {
     return q;
@@ -101,4 +188,522 @@ int main() {
     assert(kvfclear.empty());
     assert(kvf1.size() != 0);
     assert(!kvf1.empty());
+
+    kvfifo<std::string, int, kvfifo_policy::hashed_index> kvfh;
+    kvfh.push("b", 1);
+    kvfh.push("c", 2);
+    kvfh.push("a", 3);
+    kvfh.push("b", 4);
+    test_iterator(kvfh.k_begin());
+    std::string hashed_keys;
+    for (auto it = kvfh.k_begin(); it != kvfh.k_end(); ++it) {
+        hashed_keys += *it;
+    }
+    assert(hashed_keys == "abc");
+    assert(*--kvfh.k_end() == "c");
+    assert(kvfh.count("b") == 2 && kvfh.count("d") == 0);
+    assert(kvfh.first("b").second == 1 && kvfh.last("b").second == 4);
+    kvfh.move_to_back("b");
+    assert(kvfh.front().second == 2 && kvfh.back().second == 4);
+    auto kvfh2 = kvfh;
+    kvfh2.pop("c");
+    kvfh2.pop("a");
+    assert(kvfh2.size() == 2 && *kvfh2.k_begin() == "b");
+    assert(kvfh.size() == 4 && *kvfh.k_begin() == "a");
+
+    // A key is stored once, so pushing it copies it at most once.
+    kvfifo<counted_key, int> kvfc;
+    counted_key key_one(1), key_two(2);
+    int value = 0;
+    kvfc.push(key_one, value);
+    kvfc.push(key_two, value);
+    kvfc.push(key_one, value);
+    assert(counted_key::copies == 2);
+    kvfc.pop();
+    kvfc.pop(key_one);
+    kvfc.move_to_back(key_two);
+    assert(counted_key::copies == 2);
+
+    // The shared state, the nodes and the copy made on modification all come
+    // from the queue's memory resource.
+    counting_resource resource;
+    kvfifo<int, int>::pmr kvfp(&resource);
+    kvfp.push(1, 1);
+    kvfp.push(2, 2);
+    size_t allocations = resource.allocations;
+    assert(allocations > 0);
+    auto kvfp2 = kvfp;
+    assert(resource.allocations == allocations);
+    kvfp2.pop();
+    assert(resource.allocations > allocations);
+    assert(kvfp2.get_allocator().resource() == &resource);
+    kvfp2.clear();
+    assert(kvfp2.get_allocator().resource() == &resource);
+
+    // So does the sorted view of the keys of a hashed index.
+    kvfifo<int, int, kvfifo_policy::hashed_index>::pmr kvfph(&resource);
+    for (int j = 0; j < 100; ++j) {
+        kvfph.push(99 - j, j);
+    }
+    allocations = resource.allocations;
+    assert(*kvfph.k_begin() == 0 && *--kvfph.k_end() == 99);
+    assert(std::distance(kvfph.k_begin(), kvfph.k_end()) == 100);
+    assert(resource.allocations > allocations);
+    kvfph.push(100, 100); // Sorts the view again.
+    assert(std::distance(kvfph.k_begin(), kvfph.k_end()) == 101);
+    assert(kvfph.get_allocator().resource() == &resource);
+
+    // A moved-from queue is empty and usable.
+    kvfifo<int, int> kvfm;
+    kvfm.push(1, 1);
+    auto kvfm2 = std::move(kvfm);
+    assert(kvfm.empty() && kvfm.count(1) == 0 && kvfm.k_begin() == kvfm.k_end());
+    kvfm.push(2, 2);
+    assert(kvfm.size() == 1 && kvfm2.size() == 1 && kvfm2.front().first == 1);
+
+    // A copy shares the state through a single counted pointer, next to the
+    // pointer to its own front once it pops from a shared state.
+#ifndef KVFIFO_STATS
+    static_assert(sizeof(kvfifo<int, int>) <= 3 * sizeof(void *));
+#endif
+    kvfifo<int, int, kvfifo_policy::ordered_index,
+           std::allocator<std::pair<int const, int>>,
+           kvfifo_policy::plain_count> kvfpc;
+    kvfpc.push(1, 1);
+    auto kvfpc2 = kvfpc;
+    kvfpc2.push(2, 2);
+    assert(kvfpc.size() == 1 && kvfpc2.size() == 2);
+
+    // Values passed by rvalue are moved and emplaced ones are built in place.
+    kvfifo<std::string, counted_value> kvfv;
+    std::string long_key(100, 'k');
+    kvfv.push(std::move(long_key), counted_value(1, 2));
+    assert(counted_value::copies == 0 && counted_value::moves == 1);
+    kvfv.emplace("k", 3, 4);
+    assert(counted_value::copies == 0 && counted_value::moves == 1);
+    assert(kvfv.back().second.a == 3 && kvfv.back().second.b == 4);
+    assert(kvfv.front().first == std::string(100, 'k'));
+
+    // A detached copy keeps the order of the queue and of every key.
+    kvfifo<int, int, kvfifo_policy::hashed_index> kvfd;
+    for (int i = 0; i < 100; ++i) {
+        kvfd.push(i % 7, i);
+    }
+    auto kvfd2 = kvfd;
+    kvfd2.pop();
+    assert(kvfd.size() == 100 && kvfd2.size() == 99);
+    for (int i = 1; i < 100; ++i) {
+        assert(kvfd2.front().second == i);
+        if (i % 7 == 3) {
+            assert(kvfd2.first(3).second == i && kvfd2.last(3).second == 94);
+        }
+        kvfd2.pop();
+    }
+
+    // A value passed by rvalue is moved in, whatever the key is passed by.
+    kvfifo<int, counted_value> kvfmv;
+    int pushed_key = 1;
+    counted_value pushed_value(1, 1);
+    int copies_then = counted_value::copies;
+    kvfmv.push(pushed_key, counted_value(2, 2));
+    kvfmv.push(pushed_key, std::move(pushed_value));
+    assert(counted_value::copies == copies_then);
+    kvfmv.push(2, pushed_value);
+    assert(counted_value::copies == copies_then + 1);
+    assert(kvfmv.size() == 3 && kvfmv.count(1) == 2 && kvfmv.back().first == 2);
+
+    // modify_* change values in place without making later copies deep.
+    kvfifo<int, counted_value> kvfm3;
+    kvfm3.emplace(1, 1, 1);
+    kvfm3.emplace(2, 2, 2);
+    kvfm3.emplace(1, 3, 3);
+    int copies_before = counted_value::copies;
+    kvfm3.modify_front([](counted_value &v) { v.a = 10; });
+    kvfm3.modify_last(1, [](counted_value &v) { v.a = 30; });
+    auto kvfm4 = kvfm3;
+    assert(counted_value::copies == copies_before);
+    assert(kvfm3.modify_back([](counted_value &v) { return v.a; }) == 30);
+    assert(counted_value::copies == copies_before + 3);
+    assert(kvfm4.first(1).second.a == 10 && kvfm4.last(1).second.a == 30);
+    kvfm4.modify_first(2, [](counted_value &v) { v.b = 20; });
+    assert(kvfm3.first(2).second.b == 2 && kvfm4.first(2).second.b == 20);
+
+    // Popping from the front of a shared queue copies nothing.
+    kvfifo<int, counted_value> kvfs;
+    for (int j = 0; j < 6; ++j) {
+        kvfs.emplace(j % 3, j, 0);
+    }
+    auto kvfs2 = kvfs;
+    copies_before = counted_value::copies;
+    kvfs2.pop();
+    kvfs2.pop();
+    kvfs2.pop(); // The elements 0, 1, 2 are gone from kvfs2 only.
+    kvfs2.pop();
+    assert(counted_value::copies == copies_before);
+    assert(kvfs.size() == 6 && kvfs2.size() == 2);
+    assert(kvfs2.count(0) == 0 && kvfs2.count(1) == 1 && kvfs2.count(2) == 1);
+    kvfifo<int, counted_value> const &ckvfs2 = kvfs2;
+    assert(ckvfs2.front().second.a == 4 && ckvfs2.first(2).second.a == 5);
+    assert(*kvfs2.k_begin() == 1 && *--kvfs2.k_end() == 2);
+    assert(std::distance(kvfs2.k_begin(), kvfs2.k_end()) == 2);
+    try {
+        ckvfs2.first(0);
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    auto kvfs3 = kvfs2;
+    kvfs3.pop();
+    assert(kvfs2.size() == 2 && kvfs3.size() == 1 && kvfs3.front().second.a == 5);
+    kvfs = {};
+    kvfs2.push(0, counted_value(6, 0));
+    assert(kvfs2.size() == 3 && kvfs2.front().second.a == 4);
+    assert(kvfs2.first(0).second.a == 6 && kvfs2.count(0) == 1);
+
+    // Many pops from a shared queue copy what is left once, so the keys
+    // popped do not stay behind for k_iterator to skip.
+    kvfifo<int, counted_value> kvfl;
+    for (int j = 0; j < 1000; ++j) {
+        kvfl.emplace(j, j, 0);
+    }
+    auto kvfl2 = kvfl;
+    auto kvfl3 = kvfl;
+    copies_before = counted_value::copies;
+    for (int j = 0; j < 900; ++j) {
+        kvfl2.pop();
+    }
+    assert(counted_value::copies - copies_before == 500);
+    assert(*kvfl2.k_begin() == 900 && kvfl2.front().first == 900);
+    assert(std::distance(kvfl2.k_begin(), kvfl2.k_end()) == 100);
+    std::vector<std::pair<int, counted_value>> popped;
+    kvfl3.pop_n(900, std::back_inserter(popped));
+    assert(popped.size() == 900 && popped.back().first == 899);
+    assert(*kvfl3.k_begin() == 900 && kvfl3.size() == 100);
+    assert(std::distance(kvfl3.k_begin(), kvfl3.k_end()) == 100);
+    assert(kvfl.size() == 1000 && *kvfl.k_begin() == 0);
+
+    // Snapshots are read in other threads while the queue keeps changing.
+    kvfifo<int, int, kvfifo_policy::hashed_index> kvft;
+    for (int j = 0; j < 1000; ++j) {
+        kvft.push(j % 10, j);
+    }
+    auto snap = kvft.snapshot();
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([snap] {
+            for (int r = 0; r < 100; ++r) {
+                assert(snap.size() == 1000 && snap.front().second == 0);
+                assert(snap.count(3) == 100 && snap.first(3).second == 3);
+                assert(std::distance(snap.k_begin(), snap.k_end()) == 10);
+            }
+        });
+    }
+    for (int j = 0; j < 500; ++j) {
+        kvft.pop();
+        kvft.push(10 + j % 10, j);
+    }
+    kvft.move_to_back(3);
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    assert(snap.size() == 1000 && *--snap.k_end() == 9);
+    assert(kvft.size() == 1000 && kvft.back().first == 3);
+
+    // Copies sharing a state with unsorted keys walk them in different
+    // threads, the first of them sorting the keys for all.
+    for (int round = 0; round < 20; ++round) {
+        kvft.push(100 + round, round);
+        std::vector<std::thread> walkers;
+        for (int t = 0; t < 4; ++t) {
+            walkers.emplace_back([copy = kvft, round] {
+                assert(std::distance(copy.k_begin(), copy.k_end())
+                       == 21 + round);
+                assert(*--copy.k_end() == 100 + round);
+            });
+        }
+        for (auto &walker : walkers) {
+            walker.join();
+        }
+    }
+
+    // A few changes to a shared queue are kept next to it instead of copying.
+    kvfifo<int, counted_value> kvfo;
+    for (int j = 0; j < 9; ++j) {
+        kvfo.emplace(j % 3, j, 0);
+    }
+    auto kvfo2 = kvfo;
+    copies_before = counted_value::copies;
+    kvfo2.pop(1);
+    kvfo2.move_to_back(0);
+    kvfo2.push(2, counted_value(9, 0));
+    kvfo2.pop(0);
+    assert(counted_value::copies == copies_before);
+    assert(kvfo.size() == 9 && kvfo.front().second.a == 0);
+    assert(kvfo2.size() == 8 && kvfo2.count(0) == 2 && kvfo2.count(1) == 2);
+    int const order[] = {2, 4, 5, 7, 8, 3, 6, 9};
+    auto kvfo3 = kvfo2;
+    for (int a : order) {
+        assert(kvfo3.front().second.a == a);
+        kvfo3.pop();
+    }
+    assert(kvfo2.last(2).second.a == 9 && kvfo2.back().second.a == 9);
+    kvfo = {};
+    kvfo2.push(1, counted_value(10, 0)); // Applies the changes to the state.
+    assert(kvfo2.size() == 9 && kvfo2.back().second.a == 10);
+    for (int a : order) {
+        assert(kvfo2.front().second.a == a);
+        kvfo2.pop();
+    }
+    assert(kvfo2.size() == 1 && kvfo2.first(1).second.a == 10);
+
+    // A batch is pushed in its order, also into a shared queue.
+    std::vector<std::pair<int, int>> batch;
+    for (int j = 0; j < 20; ++j) {
+        batch.emplace_back((j * 7) % 4, j);
+    }
+    kvfifo<int, int> kvfb;
+    kvfb.push(5, -1);
+    kvfb.push(2, -2);
+    auto kvfb2 = kvfb;
+    kvfb.push_range(batch.begin(), batch.end());
+    kvfb.push_range(batch.end(), batch.end());
+    assert(kvfb.size() == 22 && kvfb2.size() == 2);
+    assert(kvfb.count(2) == 6 && kvfb.first(2).second == -2);
+    assert(kvfb.last(1).second == 19 && kvfb.back().second == 19);
+    assert(std::distance(kvfb.k_begin(), kvfb.k_end()) == 5);
+    kvfb.pop();
+    kvfb.pop();
+    for (auto const &[k, v] : batch) {
+        assert(kvfb.front().first == k && kvfb.front().second == v);
+        kvfb.pop();
+    }
+
+    std::vector<std::pair<std::string, std::string>> named = {
+            {"b", "x"}, {"a", "y"}, {"b", "z"}};
+    kvfifo<std::string, std::string, kvfifo_policy::hashed_index> kvfbs;
+    kvfbs.push_range(std::make_move_iterator(named.begin()),
+                     std::make_move_iterator(named.end()));
+    assert(named[0].second.empty() && named[2].second.empty());
+    assert(kvfbs.size() == 3 && kvfbs.last("b").second == "z");
+    assert(*kvfbs.k_begin() == "a" && kvfbs.front().second == "x");
+
+    // A hashed index groups a batch by hashing, so its keys need no order.
+    std::vector<std::pair<unordered_key, int>> unordered;
+    for (int j = 0; j < 20; ++j) {
+        unordered.push_back({{(j * 7) % 4}, j});
+    }
+    kvfifo<unordered_key, int, kvfifo_policy::hashed_index> kvfbu;
+    kvfbu.push({2}, -1);
+    kvfbu.push_range(unordered.begin(), unordered.end());
+    assert(kvfbu.size() == 21 && kvfbu.count({2}) == 6);
+    assert(kvfbu.first({2}).second == -1 && kvfbu.last({1}).second == 19);
+    kvfbu.pop();
+    for (auto const &[k, v] : unordered) {
+        assert(kvfbu.front().first == k && kvfbu.front().second == v);
+        kvfbu.pop();
+    }
+
+    // If a value of the batch throws, nothing of it is pushed.
+    kvfifo<int, throwing_value> kvfbt;
+    kvfbt.emplace(1, 1);
+    std::vector<std::pair<int, throwing_value>> failing;
+    for (int j = 0; j < 5; ++j) {
+        failing.emplace_back(j, j);
+    }
+    throwing_value::countdown = 4;
+    try {
+        kvfbt.push_range(failing.begin(), failing.end());
+        assert(false);
+    } catch (std::runtime_error const &) {}
+    throwing_value::countdown = -1;
+    assert(kvfbt.size() == 1 && kvfbt.count(1) == 1 && kvfbt.count(3) == 0);
+    assert(std::distance(kvfbt.k_begin(), kvfbt.k_end()) == 1);
+    kvfbt.push_range(failing.begin(), failing.end());
+    assert(kvfbt.size() == 6 && kvfbt.count(1) == 2);
+    assert(kvfbt.back().second.a == 4);
+    kvfifo<int, throwing_value, kvfifo_policy::hashed_index> kvfbh;
+    kvfbh.emplace(1, 1);
+    throwing_value::countdown = 4;
+    try {
+        kvfbh.push_range(failing.begin(), failing.end());
+        assert(false);
+    } catch (std::runtime_error const &) {}
+    throwing_value::countdown = -1;
+    assert(kvfbh.size() == 1 && kvfbh.count(1) == 1 && kvfbh.count(3) == 0);
+    assert(std::distance(kvfbh.k_begin(), kvfbh.k_end()) == 1);
+
+    // pop_n and drain copy the values out of a shared queue, and move them
+    // out of a queue of its own.
+    kvfifo<int, counted_value> kvfn;
+    for (int j = 0; j < 10; ++j) {
+        kvfn.emplace(j % 3, j, 0);
+    }
+    auto kvfn2 = kvfn;
+    std::vector<std::pair<int, counted_value>> drained;
+    drained.reserve(20);
+    copies_before = counted_value::copies;
+    kvfn2.pop_n(4, std::back_inserter(drained));
+    assert(counted_value::copies == copies_before + 4);
+    assert(kvfn.size() == 10 && kvfn2.size() == 6 && kvfn2.count(0) == 2);
+    assert(std::as_const(kvfn2).front().second.a == 4);
+    kvfn2.drain(std::back_inserter(drained));
+    assert(counted_value::copies == copies_before + 10);
+    assert(kvfn2.empty() && kvfn2.count(0) == 0);
+    kvfn.pop_n(0, std::back_inserter(drained));
+    auto end = kvfn.pop_n(3, std::back_inserter(drained));
+    *end = std::pair<int, counted_value>(-1, counted_value(-1, 0));
+    assert(kvfn.size() == 7 && kvfn.count(0) == 3 && kvfn.count(1) == 2);
+    kvfn.drain(std::back_inserter(drained));
+    assert(counted_value::copies == copies_before + 10);
+    assert(kvfn.empty() && std::distance(kvfn.k_begin(), kvfn.k_end()) == 0);
+    int const drained_order[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0, 1, 2, -1,
+                                 3, 4, 5, 6, 7, 8, 9};
+    assert(drained.size() == 21);
+    for (size_t j = 0; j < drained.size(); ++j) {
+        assert(drained[j].second.a == drained_order[j]);
+        assert(drained[j].first == (j == 13 ? -1 : drained_order[j] % 3));
+    }
+    kvfn.emplace(5, 5, 5);
+    assert(kvfn.size() == 1 && kvfn.front().first == 5);
+
+    // pop_all removes every element of a key, moving the values out of a
+    // queue of its own and copying them out of a shared one.
+    kvfifo<int, counted_value> kvfa;
+    for (int j = 0; j < 12; ++j) {
+        kvfa.emplace(j % 4, j, 0);
+    }
+    auto kvfa2 = kvfa;
+    std::vector<counted_value> values;
+    copies_before = counted_value::copies;
+    kvfa2.pop_all(1, std::back_inserter(values));
+    assert(counted_value::copies == copies_before + 3);
+    assert(kvfa.count(1) == 3 && kvfa2.count(1) == 0 && kvfa2.size() == 9);
+    assert(std::distance(kvfa2.k_begin(), kvfa2.k_end()) == 3);
+    kvfa2.pop_all(0);
+    assert(kvfa2.size() == 6 && std::as_const(kvfa2).front().second.a == 2);
+    kvfa2 = {};
+    copies_before = counted_value::copies;
+    kvfa.pop();
+    kvfa.pop_all(2, std::back_inserter(values));
+    assert(counted_value::copies == copies_before);
+    assert(kvfa.size() == 8 && kvfa.count(2) == 0 && kvfa.count(0) == 2);
+    assert(kvfa.front().second.a == 1 && kvfa.back().second.a == 11);
+    kvfa.pop_all(3);
+    kvfa.pop_all(0);
+    kvfa.pop_all(1);
+    assert(kvfa.empty() && std::distance(kvfa.k_begin(), kvfa.k_end()) == 0);
+    try {
+        kvfa.pop_all(1);
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    int const popped_values[] = {1, 5, 9, 2, 6, 10};
+    assert(values.size() == 6);
+    for (size_t j = 0; j < values.size(); ++j) {
+        assert(values[j].a == popped_values[j]);
+    }
+
+    // Moving several keys to the back at once does what moving them one by
+    // one does, copying a shared state at most once.
+    kvfifo<int, counted_value> kvfk;
+    for (int j = 0; j < 100; ++j) {
+        kvfk.emplace(j % 5, j, 0);
+    }
+    auto kvfk2 = kvfk;
+    auto kvfk3 = kvfk;
+    std::vector<int> moved_keys = {3, 0, 3, 1, 2};
+    copies_before = counted_value::copies;
+    kvfk2.move_to_back(moved_keys.begin(), moved_keys.end());
+    assert(counted_value::copies == copies_before + 100);
+    for (int k : moved_keys) {
+        kvfk3.move_to_back(k);
+    }
+    assert(kvfk.front().second.a == 0 && kvfk2.size() == 100);
+    for (int k : {4, 0, 3, 1, 2}) {
+        assert(std::as_const(kvfk2).front().first == k);
+        for (int j = 0; j < 20; ++j) {
+            assert(std::as_const(kvfk2).front().second.a
+                   == std::as_const(kvfk3).front().second.a);
+            kvfk2.pop();
+            kvfk3.pop();
+        }
+    }
+    moved_keys.push_back(7);
+    try {
+        kvfk.move_to_back(moved_keys.begin(), moved_keys.end());
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    assert(kvfk.front().second.a == 0 && kvfk.back().second.a == 99);
+    kvfk.move_to_back(moved_keys.begin(), moved_keys.begin());
+    int few[] = {1, 0};
+    kvfifo<int, counted_value> kvfk4;
+    for (int j = 0; j < 6; ++j) {
+        kvfk4.emplace(j % 3, j, 0);
+    }
+    auto kvfk5 = kvfk4;
+    copies_before = counted_value::copies;
+    kvfk5.move_to_back(std::begin(few), std::end(few));
+    assert(counted_value::copies == copies_before);
+    assert(std::as_const(kvfk5).front().second.a == 2);
+    assert(std::as_const(kvfk5).back().second.a == 3);
+    assert(std::as_const(kvfk4).front().second.a == 0);
+
+    // Moving a key to the front keeps the order of its elements and of the
+    // others.
+    kvfifo<int, int> kvff;
+    for (int j = 0; j < 12; ++j) {
+        kvff.push(j % 7 % 3, j);
+    }
+    auto kvff2 = kvff;
+    kvff.move_to_front(2);
+    assert(kvff2.front().second == 0 && kvff.size() == 12);
+    for (int j : {2, 5, 9, 0, 1, 3, 4, 6, 7, 8, 10, 11}) {
+        assert(kvff.front().second == j);
+        kvff.pop();
+    }
+    kvff2.move_to_front(0);
+    kvff2.move_to_front(0);
+    assert(kvff2.first(0).second == 0 && kvff2.last(0).second == 10);
+    assert(kvff2.front().second == 0 && kvff2.back().second == 11);
+    kvff2.move_to_front(1);
+    assert(kvff2.front().second == 1 && kvff2.count(1) == 4);
+    kvff2.move_to_back(1);
+    kvff2.move_to_front(2);
+    for (int j : {2, 5, 9, 0, 3, 6, 7, 10, 1, 4, 8, 11}) {
+        assert(kvff2.front().second == j);
+        kvff2.pop();
+    }
+    try {
+        kvff2.move_to_front(1);
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    kvfifo<int, counted_value> kvff3;
+    kvff3.emplace(1, 1, 0);
+    kvff3.emplace(2, 2, 0);
+    auto kvff4 = kvff3;
+    copies_before = counted_value::copies;
+    kvff4.move_to_front(1);
+    assert(counted_value::copies == copies_before);
+    kvff4.move_to_front(2);
+    assert(counted_value::copies == copies_before + 2);
+    assert(std::as_const(kvff3).front().second.a == 1);
+    assert(std::as_const(kvff4).front().second.a == 2);
+
+#ifdef KVFIFO_STATS
+    // Each copy of a shared state is counted at its call site.
+    kvfifo_stats global_before = kvfifo_global_stats();
+    kvfifo<int, int> kvfc1;
+    kvfc1.push(1, 1);
+    kvfc1.push(2, 2);
+    auto kvfc2 = kvfc1;
+    kvfc2.first(1);
+    auto kvfc3 = kvfc1;
+    kvfc1.front();
+    auto kvfc4 = kvfc1;
+    assert(kvfc1.stats().detaches[kvfifo_stats::front] == 1);
+    assert(kvfc2.stats().detaches[kvfifo_stats::first] == 1);
+    assert(kvfc2.stats().elements_copied == 2);
+    assert(kvfc4.stats().detaches[kvfifo_stats::copy_constructor] == 1);
+    kvfifo_stats global = kvfifo_global_stats();
+    assert(global.elements_copied - global_before.elements_copied == 6);
+    assert(global.keys_copied - global_before.keys_copied == 6);
+    assert(global.bytes_copied > global_before.bytes_copied);
+#endif
 }
@@ -0,0 +1,245 @@
+#ifndef __MPSC_KVFIFO_H__
+#define __MPSC_KVFIFO_H__
+
+#include "kvfifo.h"
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// A kvfifo for many producer threads and one consumer thread. push and
+// emplace may be called from any thread and never take a lock: they link the
+// element onto an intake stack with a compare-and-swap. Everything else
+// belongs to the consumer, which moves the pending elements into the queue,
+// in push order, before each of its operations. Producers therefore never
+// wait for the key index, and the consumer never waits for the producers.
+//
+// The elements a producer pushed come out in its push order; the pushes of
+// different producers are ordered by their compare-and-swap.
+template <typename K, typename V>
+class mpsc_kvfifo {
+private:
+    struct kv_pending {
+        kv_pending *next;
+        K key;
+        V value;
+
+        template <typename Key, typename... Args>
+        explicit kv_pending(Key &&k, Args &&...args)
+            : next(nullptr),
+              key(std::forward<Key>(k)),
+              value(std::forward<Args>(args)...) {}
+    };
+
+    // Newest first.
+    std::atomic<kv_pending *> intake;
+    // Taken from the intake but not in the queue yet, oldest first. Only the
+    // consumer sees it.
+    kv_pending *taken;
+    kvfifo<K, V> queue;
+
+    template <typename Key, typename... Args>
+    void emplace_key(Key &&k, Args &&...args);
+    void fold();
+
+    static void free_list(kv_pending *list) noexcept;
+
+public:
+    mpsc_kvfifo() noexcept;
+    mpsc_kvfifo(mpsc_kvfifo const &) = delete;
+    mpsc_kvfifo& operator=(mpsc_kvfifo const &) = delete;
+    ~mpsc_kvfifo() noexcept;
+
+    // Any thread. If they throw, nothing was pushed.
+    void push(K const &k, V const &v);
+    void push(K const &k, V &&v);
+    void push(K &&k, V const &v);
+    void push(K &&k, V &&v);
+
+    template <typename... Args>
+    void emplace(K const &k, Args &&...args);
+    template <typename... Args>
+    void emplace(K &&k, Args &&...args);
+
+    // The consumer thread only. They behave as in kvfifo, with every push
+    // that completed before the call already in the queue.
+    void pop();
+    void pop(K const &k);
+
+    void move_to_back(K const &k);
+
+    std::pair<K const &, V &> front();
+    std::pair<K const &, V &> back();
+    std::pair<K const &, V &> first(K const &key);
+    std::pair<K const &, V &> last(K const &key);
+
+    size_t size();
+    size_t count(K const &k);
+    bool empty();
+};
+
+template <typename K, typename V>
+mpsc_kvfifo<K, V>::mpsc_kvfifo() noexcept
+    : intake(nullptr),
+      taken(nullptr) {}
+
+template <typename K, typename V>
+mpsc_kvfifo<K, V>::~mpsc_kvfifo() noexcept {
+    free_list(intake.load(std::memory_order_acquire));
+    free_list(taken);
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::free_list(kv_pending *list) noexcept {
+    while (list != nullptr) {
+        delete std::exchange(list, list->next);
+    }
+}
+
+template <typename K, typename V>
+template <typename Key, typename... Args>
+void mpsc_kvfifo<K, V>::emplace_key(Key &&k, Args &&...args) {
+    auto *element = new kv_pending(std::forward<Key>(k),
+                                   std::forward<Args>(args)...);
+    element->next = intake.load(std::memory_order_relaxed);
+    while (!intake.compare_exchange_weak(element->next, element,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+}
+
+// Takes the whole intake at once and reverses it into push order. If a push
+// into the queue throws, the elements not moved yet stay taken, and the next
+// operation of the consumer starts with them. A push of rvalues only throws
+// before touching them when K and V move without throwing; otherwise the key
+// may be moved into the queue before building the value throws, so they are
+// copied instead. Types that cannot be copied are still moved, and the
+// element whose push throws is then lost.
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::fold() {
+    constexpr bool move = std::is_nothrow_move_constructible_v<K>
+                          && std::is_nothrow_move_constructible_v<V>;
+    constexpr bool copy = std::is_copy_constructible_v<K>
+                          && std::is_copy_constructible_v<V>;
+    kv_pending *newest = intake.exchange(nullptr, std::memory_order_acquire);
+    if (newest != nullptr) {
+        kv_pending *oldest = nullptr;
+        while (newest != nullptr) {
+            oldest = std::exchange(newest, std::exchange(newest->next, oldest));
+        }
+        kv_pending **end = &taken;
+        while (*end != nullptr) {
+            end = &(*end)->next;
+        }
+        *end = oldest;
+    }
+    while (taken != nullptr) {
+        if constexpr (move || !copy) {
+            try {
+                queue.push(std::move(taken->key), std::move(taken->value));
+            } catch (...) {
+                if constexpr (!move) {
+                    delete std::exchange(taken, taken->next);
+                }
+                throw;
+            }
+        } else {
+            queue.push(std::as_const(taken->key), std::as_const(taken->value));
+        }
+        delete std::exchange(taken, taken->next);
+    }
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::push(K const &k, V const &v) {
+    emplace_key(k, v);
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::push(K const &k, V &&v) {
+    emplace_key(k, std::move(v));
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::push(K &&k, V const &v) {
+    emplace_key(std::move(k), v);
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::push(K &&k, V &&v) {
+    emplace_key(std::move(k), std::move(v));
+}
+
+template <typename K, typename V>
+template <typename... Args>
+void mpsc_kvfifo<K, V>::emplace(K const &k, Args &&...args) {
+    emplace_key(k, std::forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+template <typename... Args>
+void mpsc_kvfifo<K, V>::emplace(K &&k, Args &&...args) {
+    emplace_key(std::move(k), std::forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::pop() {
+    fold();
+    queue.pop();
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::pop(K const &k) {
+    fold();
+    queue.pop(k);
+}
+
+template <typename K, typename V>
+void mpsc_kvfifo<K, V>::move_to_back(K const &k) {
+    fold();
+    queue.move_to_back(k);
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> mpsc_kvfifo<K, V>::front() {
+    fold();
+    return queue.front();
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> mpsc_kvfifo<K, V>::back() {
+    fold();
+    return queue.back();
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> mpsc_kvfifo<K, V>::first(K const &key) {
+    fold();
+    return queue.first(key);
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> mpsc_kvfifo<K, V>::last(K const &key) {
+    fold();
+    return queue.last(key);
+}
+
+template <typename K, typename V>
+size_t mpsc_kvfifo<K, V>::size() {
+    fold();
+    return queue.size();
+}
+
+template <typename K, typename V>
+size_t mpsc_kvfifo<K, V>::count(K const &k) {
+    fold();
+    return queue.count(k);
+}
+
+template <typename K, typename V>
+bool mpsc_kvfifo<K, V>::empty() {
+    return size() == 0;
+}
+
+#endif  // __MPSC_KVFIFO_H__
@@ -0,0 +1,123 @@
+#include "mpsc_kvfifo.h"
+#include <atomic>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using mq = mpsc_kvfifo<int, int>;
+
+// Its copies and moves throw while fail is set.
+struct fragile_value {
+    static inline bool fail = false;
+
+    int a;
+
+    fragile_value(int a) : a(a) {}
+    fragile_value(fragile_value const &other) : a(other.a) {
+        if (fail) {
+            throw std::runtime_error("copy failed");
+        }
+    }
+    fragile_value(fragile_value &&other) : a(other.a) {
+        if (fail) {
+            throw std::runtime_error("move failed");
+        }
+    }
+    fragile_value& operator=(fragile_value const &) = default;
+};
+
+int main() {
+    int keys[] = {3, 1, 2};
+    mq q1;
+    assert(q1.empty());
+    for (int i = 0; i < 3; ++i)
+        q1.push(keys[i], i);
+    q1.push(1, 3);
+    assert(q1.size() == 4 && q1.count(1) == 2 && q1.count(4) == 0);
+    assert(q1.front().second == 0 && q1.back().second == 3);
+    assert(q1.first(1).second == 1 && q1.last(1).second == 3);
+    q1.front().second = 10;
+    q1.move_to_back(3);
+    assert(q1.front().second == 1 && q1.last(3).second == 10);
+    q1.pop(1);
+    assert(q1.first(1).second == 3);
+    try {
+        q1.pop(4);
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    q1.pop();
+    q1.pop();
+    q1.pop();
+    assert(q1.empty());
+    try {
+        q1.pop();
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+
+    // Elements still in the intake are freed with the queue.
+    mpsc_kvfifo<std::string, std::string> qs;
+    qs.emplace("a", 3, 'x');
+    qs.push(std::string("b"), std::string("y"));
+    assert(qs.front().second == "xxx" && qs.last("b").second == "y");
+    qs.push("c", "z");
+
+    // An element whose push into the queue throws is retried intact, key and
+    // value, by the next operation of the consumer.
+    mpsc_kvfifo<std::string, fragile_value> qf;
+    std::string const long_key(100, 'k');
+    qf.push(long_key, fragile_value(1));
+    qf.push(std::string(long_key), fragile_value(2));
+    fragile_value::fail = true;
+    try {
+        qf.size();
+        assert(false);
+    } catch (std::runtime_error const &) {}
+    fragile_value::fail = false;
+    assert(qf.size() == 2 && qf.count(long_key) == 2);
+    assert(qf.front().first == long_key && qf.front().second.a == 1);
+    assert(qf.last(long_key).second.a == 2);
+
+    // The consumer pops while the producers push. Every element comes out
+    // exactly once, and the elements of a producer come out in push order.
+    int const producers = 4, per_producer = 50000;
+    mq q2;
+    std::atomic<int> running = producers;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&q2, &running, p] {
+            for (int i = 0; i < per_producer; ++i) {
+                q2.push(p, i);
+            }
+            --running;
+        });
+    }
+    std::vector<int> next(producers, 0);
+    int popped = 0;
+    while (popped < producers * per_producer) {
+        if (q2.empty()) {
+            assert(running.load() > 0);
+            std::this_thread::yield();
+            continue;
+        }
+        auto [k, v] = q2.front();
+        assert(v == next[k]);
+        assert(q2.first(k).second == v);
+        ++next[k];
+        // Every other time, by key.
+        if (popped % 2 == 0) {
+            q2.pop();
+        } else {
+            q2.pop(k);
+        }
+        ++popped;
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    assert(q2.empty());
+    for (int n : next) {
+        assert(n == per_producer);
+    }
+}
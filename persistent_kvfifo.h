@@ -0,0 +1,769 @@
+#ifndef __PERSISTENT_KVFIFO_H__
+#define __PERSISTENT_KVFIFO_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// A kvfifo whose copies share structure rather than the whole state. The queue
+// and the key index are persistent AVL trees, and a modification copies only
+// the nodes on the paths it touches. The first modification of a copy
+// therefore costs O(log n), where kvfifo detaches the copy in O(n). In return
+// every modification allocates O(log n) nodes even when nothing is shared,
+// so kvfifo stays the better choice unless copies are modified often.
+//
+// The queue maps sequence numbers, given out in push order, to the elements;
+// the index maps every key to the sequence numbers of its elements. Keys and
+// values live in nodes of their own that the trees point at, so copying a
+// path never copies K or V, and a key is stored once however many elements
+// have it.
+//
+// push, emplace, pop, front, back, first, last, count:  O(log n)
+// move_to_back:                                         O(m log n)
+// k_iterator steps:                                     O(log n)
+// copy:   O(1); after a non-const front, back, first or last, up to O(n), as
+//         the copy may not share what the returned references point at.
+//
+// Copies may be used and destroyed in different threads, as long as each
+// copy is used by one thread at a time.
+template <typename K, typename V>
+class persistent_kvfifo {
+private:
+    template <typename Key, typename T, typename Probe = Key>
+    class kv_tree;
+
+    struct kv_element;
+    struct kv_no_value {};
+
+    using key_ptr = std::shared_ptr<K const>;
+    using element_ptr = std::shared_ptr<kv_element>;
+    using seq_tree = kv_tree<std::uint64_t, kv_no_value>;
+
+    // Index record of a key: how many elements have it and their sequence
+    // numbers.
+    struct kv_record {
+        size_t count = 0;
+        seq_tree seqs;
+    };
+
+    using fifo_tree = kv_tree<std::uint64_t, element_ptr>;
+    using key_tree = kv_tree<key_ptr, kv_record, K>;
+    using key_node = typename key_tree::node;
+
+    fifo_tree fifo;
+    key_tree keys;
+    size_t elements;
+    std::uint64_t next_seq;
+    bool modifiable_from_outside;
+
+    template <typename T>
+    static bool is_own(std::shared_ptr<T> const &p) noexcept;
+
+    void swap(persistent_kvfifo &other) noexcept;
+
+    void check_not_empty() const;
+    key_node const *find_key(K const &k) const;
+
+    template <typename Key, typename... Args>
+    void emplace_key(Key &&k, Args &&...args);
+    void erase_element(key_node const *entry, std::uint64_t seq);
+    kv_element &unshare_element(std::uint64_t seq);
+    fifo_tree unshared_fifo() const;
+
+public:
+    persistent_kvfifo() noexcept;
+    persistent_kvfifo(persistent_kvfifo const &);
+    persistent_kvfifo(persistent_kvfifo &&) noexcept;
+    ~persistent_kvfifo() noexcept = default;
+
+    persistent_kvfifo& operator=(persistent_kvfifo other);
+
+    // If push or emplace throws, the queue is unchanged, although a key or
+    // value passed by rvalue may have been moved from. emplace constructs
+    // the value in place from args.
+    void push(K const &k, V const &v);
+    void push(K const &k, V &&v);
+    void push(K &&k, V const &v);
+    void push(K &&k, V &&v);
+
+    template <typename... Args>
+    void emplace(K const &k, Args &&...args);
+    template <typename... Args>
+    void emplace(K &&k, Args &&...args);
+
+    void pop();
+    void pop(K const &);
+
+    void move_to_back(K const &k);
+
+    std::pair<K const &, V &> front();
+    std::pair<K const &, V const &> front() const;
+    std::pair<K const &, V &> back();
+    std::pair<K const &, V const &> back() const;
+
+    std::pair<K const &, V &> first(K const &key);
+    std::pair<K const &, V const &> first(K const &key) const;
+    std::pair<K const &, V &> last(K const &key);
+    std::pair<K const &, V const &> last(K const &key) const;
+
+    // Call fn on the value of the element and return what it returns, like
+    // in kvfifo: copies made afterwards still share all the nodes.
+    template <typename F>
+    decltype(auto) modify_front(F &&fn);
+    template <typename F>
+    decltype(auto) modify_back(F &&fn);
+    template <typename F>
+    decltype(auto) modify_first(K const &key, F &&fn);
+    template <typename F>
+    decltype(auto) modify_last(K const &key, F &&fn);
+
+    size_t size() const noexcept;
+    size_t count(K const &) const;
+    bool empty() const noexcept;
+
+    void clear() noexcept;
+
+    class k_iterator;
+
+    k_iterator k_begin() const noexcept;
+    k_iterator k_end() const noexcept;
+};
+
+// Persistent AVL tree: a counted pointer to the root. Operations that change
+// the tree return a new one, sharing every node off the changed paths. Key
+// and T must not throw when copied; nodes are compared by the Probe a Key is
+// or points at.
+template <typename K, typename V>
+template <typename Key, typename T, typename Probe>
+class persistent_kvfifo<K, V>::kv_tree {
+public:
+    struct node;
+    using node_ptr = std::shared_ptr<node>;
+
+    struct node {
+        Key key;
+        T value;
+        node_ptr left;
+        node_ptr right;
+        int height;
+    };
+
+    kv_tree() noexcept = default;
+
+    node const *root_node() const noexcept { return root.get(); }
+
+    node const *find(Probe const &k) const {
+        node const *t = root.get();
+        while (t != nullptr) {
+            if (k < probe_of(t->key)) {
+                t = t->left.get();
+            } else if (probe_of(t->key) < k) {
+                t = t->right.get();
+            } else {
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    node const *min() const noexcept { return min(root.get()); }
+    node const *max() const noexcept { return max(root.get()); }
+
+    static node const *min(node const *t) noexcept {
+        while (t != nullptr && t->left != nullptr) {
+            t = t->left.get();
+        }
+        return t;
+    }
+
+    static node const *max(node const *t) noexcept {
+        while (t != nullptr && t->right != nullptr) {
+            t = t->right.get();
+        }
+        return t;
+    }
+
+    // The node of the smallest key greater than k in the tree rooted at t.
+    static node const *next(node const *t, Probe const &k) {
+        node const *found = nullptr;
+        while (t != nullptr) {
+            if (k < probe_of(t->key)) {
+                found = t;
+                t = t->left.get();
+            } else {
+                t = t->right.get();
+            }
+        }
+        return found;
+    }
+
+    // The node of the greatest key less than k in the tree rooted at t.
+    static node const *prev(node const *t, Probe const &k) {
+        node const *found = nullptr;
+        while (t != nullptr) {
+            if (probe_of(t->key) < k) {
+                found = t;
+                t = t->right.get();
+            } else {
+                t = t->left.get();
+            }
+        }
+        return found;
+    }
+
+    // Inserts key, or gives it a new value if it is already there.
+    kv_tree inserted(Key const &key, T const &value) const {
+        return kv_tree(insert(root, key, value));
+    }
+
+    // k has to be in the tree.
+    kv_tree erased(Probe const &k) const {
+        return kv_tree(erase(root, k));
+    }
+
+    // Copies the nodes on the path to k (which has to be in the tree) that
+    // other trees share, so the node of k may be modified in place. If that
+    // throws, the tree keeps its contents, partly in new nodes.
+    node *unshare_path(Probe const &k) {
+        node_ptr *t = &root;
+        while (true) {
+            if (!is_own(*t)) {
+                *t = std::make_shared<node>(**t);
+            }
+            node *n = t->get();
+            if (k < probe_of(n->key)) {
+                t = &n->left;
+            } else if (probe_of(n->key) < k) {
+                t = &n->right;
+            } else {
+                return n;
+            }
+        }
+    }
+
+    // A tree with copies of the nodes that no other tree shares, and of the
+    // values in them as copy_value returns them. The nodes that are shared
+    // already cannot have been modified in place since they were shared.
+    template <typename F>
+    kv_tree unshared(F const &copy_value) const {
+        return kv_tree(unshare(root, copy_value));
+    }
+
+    // Calls f on the nodes in the order of their keys.
+    template <typename F>
+    void for_each(F const &f) const {
+        for_each(root.get(), f);
+    }
+
+private:
+    node_ptr root;
+
+    explicit kv_tree(node_ptr root) noexcept : root(std::move(root)) {}
+
+    static Probe const &probe_of(Key const &key) noexcept {
+        if constexpr (std::is_same_v<Key, Probe>) {
+            return key;
+        } else {
+            return *key;
+        }
+    }
+
+    static int height(node_ptr const &t) noexcept {
+        return t == nullptr ? 0 : t->height;
+    }
+
+    static node_ptr make(Key const &key, T const &value, node_ptr left,
+                         node_ptr right) {
+        int h = 1 + std::max(height(left), height(right));
+        return std::make_shared<node>(key, value, std::move(left),
+                                      std::move(right), h);
+    }
+
+    // make, with the rotations that restore the balance when the heights of
+    // the subtrees differ by two.
+    static node_ptr balance(Key const &key, T const &value, node_ptr left,
+                            node_ptr right) {
+        if (height(left) > height(right) + 1) {
+            node const &l = *left;
+            if (height(l.left) >= height(l.right)) {
+                return make(l.key, l.value, l.left,
+                            make(key, value, l.right, std::move(right)));
+            }
+            node const &lr = *l.right;
+            return make(lr.key, lr.value, make(l.key, l.value, l.left, lr.left),
+                        make(key, value, lr.right, std::move(right)));
+        }
+        if (height(right) > height(left) + 1) {
+            node const &r = *right;
+            if (height(r.right) >= height(r.left)) {
+                return make(r.key, r.value,
+                            make(key, value, std::move(left), r.left), r.right);
+            }
+            node const &rl = *r.left;
+            return make(rl.key, rl.value,
+                        make(key, value, std::move(left), rl.left),
+                        make(r.key, r.value, rl.right, r.right));
+        }
+        return make(key, value, std::move(left), std::move(right));
+    }
+
+    static node_ptr insert(node_ptr const &t, Key const &key,
+                           T const &value) {
+        if (t == nullptr) {
+            return make(key, value, nullptr, nullptr);
+        }
+        if (probe_of(key) < probe_of(t->key)) {
+            return balance(t->key, t->value, insert(t->left, key, value),
+                           t->right);
+        }
+        if (probe_of(t->key) < probe_of(key)) {
+            return balance(t->key, t->value, t->left,
+                           insert(t->right, key, value));
+        }
+        return make(t->key, value, t->left, t->right);
+    }
+
+    static node_ptr erase(node_ptr const &t, Probe const &k) {
+        if (k < probe_of(t->key)) {
+            return balance(t->key, t->value, erase(t->left, k), t->right);
+        }
+        if (probe_of(t->key) < k) {
+            return balance(t->key, t->value, t->left, erase(t->right, k));
+        }
+        if (t->left == nullptr) {
+            return t->right;
+        }
+        if (t->right == nullptr) {
+            return t->left;
+        }
+        node const *successor = min(t->right.get());
+        return balance(successor->key, successor->value, t->left,
+                       erase_min(t->right));
+    }
+
+    static node_ptr erase_min(node_ptr const &t) {
+        if (t->left == nullptr) {
+            return t->right;
+        }
+        return balance(t->key, t->value, erase_min(t->left), t->right);
+    }
+
+    template <typename F>
+    static node_ptr unshare(node_ptr const &t, F const &copy_value) {
+        if (t == nullptr || !is_own(t)) {
+            return t;
+        }
+        node_ptr left = unshare(t->left, copy_value);
+        node_ptr right = unshare(t->right, copy_value);
+        return make(t->key, copy_value(t->value), std::move(left),
+                    std::move(right));
+    }
+
+    template <typename F>
+    static void for_each(node const *t, F const &f) {
+        if (t != nullptr) {
+            for_each(t->left.get(), f);
+            f(*t);
+            for_each(t->right.get(), f);
+        }
+    }
+};
+
+template <typename K, typename V>
+struct persistent_kvfifo<K, V>::kv_element {
+    key_ptr key;
+    V value;
+
+    template <typename... Args>
+    explicit kv_element(key_ptr key, Args &&...args)
+        : key(std::move(key)), value(std::forward<Args>(args)...) {}
+};
+
+// Finds the neighbouring keys from the root of the index, so it needs no
+// stack and stays valid as long as the index it was taken from.
+template <typename K, typename V>
+class persistent_kvfifo<K, V>::k_iterator {
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = K;
+    using difference_type = std::ptrdiff_t;
+    using pointer = K const *;
+    using reference = K const &;
+
+    k_iterator() = default;
+
+    reference operator*() const noexcept { return *current->key; }
+    pointer operator->() const noexcept { return &**this; }
+
+    k_iterator& operator++() {
+        current = key_tree::next(root, *current->key);
+        return *this;
+    }
+
+    k_iterator operator++(int) {
+        k_iterator old = *this;
+        ++*this;
+        return old;
+    }
+
+    k_iterator& operator--() {
+        current = current == nullptr ? key_tree::max(root)
+                                     : key_tree::prev(root, *current->key);
+        return *this;
+    }
+
+    k_iterator operator--(int) {
+        k_iterator old = *this;
+        --*this;
+        return old;
+    }
+
+    bool operator==(k_iterator const &) const noexcept = default;
+
+private:
+    friend class persistent_kvfifo;
+
+    k_iterator(key_node const *root, key_node const *current) noexcept
+        : root(root), current(current) {}
+
+    key_node const *root = nullptr;
+    key_node const *current = nullptr;
+};
+
+template <typename K, typename V>
+persistent_kvfifo<K, V>::persistent_kvfifo() noexcept
+    : elements(0),
+      next_seq(0),
+      modifiable_from_outside(false) {}
+
+template <typename K, typename V>
+persistent_kvfifo<K, V>::persistent_kvfifo(persistent_kvfifo const &other)
+    : fifo(other.modifiable_from_outside ? other.unshared_fifo()
+                                         : other.fifo),
+      keys(other.keys),
+      elements(other.elements),
+      next_seq(other.next_seq),
+      modifiable_from_outside(false) {}
+
+template <typename K, typename V>
+persistent_kvfifo<K, V>::persistent_kvfifo(persistent_kvfifo &&other) noexcept
+    : fifo(std::exchange(other.fifo, fifo_tree())),
+      keys(std::exchange(other.keys, key_tree())),
+      elements(std::exchange(other.elements, 0)),
+      next_seq(other.next_seq),
+      modifiable_from_outside(
+              std::exchange(other.modifiable_from_outside, false)) {}
+
+template <typename K, typename V>
+persistent_kvfifo<K, V>&
+persistent_kvfifo<K, V>::operator=(persistent_kvfifo other) {
+    swap(other);
+    return *this;
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::swap(persistent_kvfifo &other) noexcept {
+    std::swap(other.fifo, fifo);
+    std::swap(other.keys, keys);
+    std::swap(other.elements, elements);
+    std::swap(other.next_seq, next_seq);
+    std::swap(other.modifiable_from_outside, modifiable_from_outside);
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::check_not_empty() const {
+    if (empty()) {
+        throw std::invalid_argument("Queue is empty!");
+    }
+}
+
+template <typename K, typename V>
+typename persistent_kvfifo<K, V>::key_node const *
+persistent_kvfifo<K, V>::find_key(K const &k) const {
+    if (key_node const *entry = keys.find(k)) {
+        return entry;
+    }
+    throw std::invalid_argument("No such key in the queue!");
+}
+
+// Both trees are built before either is replaced, so nothing changes if
+// anything throws.
+template <typename K, typename V>
+template <typename Key, typename... Args>
+void persistent_kvfifo<K, V>::emplace_key(Key &&k, Args &&...args) {
+    key_node const *entry = keys.find(k);
+    key_ptr key = entry != nullptr
+            ? entry->key : std::make_shared<K const>(std::forward<Key>(k));
+    auto element = std::make_shared<kv_element>(key,
+                                                std::forward<Args>(args)...);
+    kv_record record = entry != nullptr ? entry->value : kv_record();
+    ++record.count;
+    record.seqs = record.seqs.inserted(next_seq, kv_no_value());
+    fifo_tree pushed_fifo = fifo.inserted(next_seq, element);
+    key_tree pushed_keys = keys.inserted(key, record);
+    fifo = std::move(pushed_fifo);
+    keys = std::move(pushed_keys);
+    ++elements;
+    ++next_seq;
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::erase_element(key_node const *entry,
+                                            std::uint64_t seq) {
+    kv_record const &record = entry->value;
+    fifo_tree popped_fifo = fifo.erased(seq);
+    key_tree popped_keys = record.count == 1
+            ? keys.erased(*entry->key)
+            : keys.inserted(entry->key, kv_record{record.count - 1,
+                                                  record.seqs.erased(seq)});
+    fifo = std::move(popped_fifo);
+    keys = std::move(popped_keys);
+    --elements;
+    modifiable_from_outside = false;
+}
+
+// Whether p is the only pointer to its object, which may then be modified in
+// place. use_count is a relaxed load, so the fence makes the reads of another
+// copy, made before it let go of the object, happen before that.
+template <typename K, typename V>
+template <typename T>
+bool persistent_kvfifo<K, V>::is_own(std::shared_ptr<T> const &p) noexcept {
+    if (p.use_count() != 1) {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
+// Makes the element with the given sequence number this queue's own, so a
+// reference to it may be handed out.
+template <typename K, typename V>
+typename persistent_kvfifo<K, V>::kv_element &
+persistent_kvfifo<K, V>::unshare_element(std::uint64_t seq) {
+    element_ptr &element = fifo.unshare_path(seq)->value;
+    if (!is_own(element)) {
+        element = std::make_shared<kv_element>(*element);
+    }
+    return *element;
+}
+
+// The queue without the nodes and elements only this queue holds, which the
+// references handed out may point at.
+template <typename K, typename V>
+typename persistent_kvfifo<K, V>::fifo_tree
+persistent_kvfifo<K, V>::unshared_fifo() const {
+    return fifo.unshared([](element_ptr const &element) {
+        return is_own(element)
+                ? std::make_shared<kv_element>(*element) : element;
+    });
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::push(K const &k, V const &v) {
+    emplace_key(k, v);
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::push(K const &k, V &&v) {
+    emplace_key(k, std::move(v));
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::push(K &&k, V const &v) {
+    emplace_key(std::move(k), v);
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::push(K &&k, V &&v) {
+    emplace_key(std::move(k), std::move(v));
+}
+
+template <typename K, typename V>
+template <typename... Args>
+void persistent_kvfifo<K, V>::emplace(K const &k, Args &&...args) {
+    emplace_key(k, std::forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+template <typename... Args>
+void persistent_kvfifo<K, V>::emplace(K &&k, Args &&...args) {
+    emplace_key(std::move(k), std::forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::pop() {
+    check_not_empty();
+    auto const *oldest = fifo.min();
+    erase_element(keys.find(*oldest->value->key), oldest->key);
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::pop(K const &k) {
+    key_node const *entry = find_key(k);
+    erase_element(entry, entry->value.seqs.min()->key);
+}
+
+// Every moved element gets a new sequence number, so this costs a removal and
+// an insertion in the queue per element.
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::move_to_back(K const &k) {
+    key_node const *entry = find_key(k);
+    fifo_tree moved_fifo = fifo;
+    seq_tree moved_seqs;
+    std::uint64_t seq = next_seq;
+    entry->value.seqs.for_each([&](typename seq_tree::node const &old) {
+        element_ptr const &element = fifo.find(old.key)->value;
+        moved_fifo = moved_fifo.erased(old.key).inserted(seq, element);
+        moved_seqs = moved_seqs.inserted(seq, kv_no_value());
+        ++seq;
+    });
+    key_tree moved_keys = keys.inserted(
+            entry->key, kv_record{entry->value.count, moved_seqs});
+    fifo = std::move(moved_fifo);
+    keys = std::move(moved_keys);
+    next_seq = seq;
+    modifiable_from_outside = false;
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> persistent_kvfifo<K, V>::front() {
+    check_not_empty();
+    kv_element &element = unshare_element(fifo.min()->key);
+    modifiable_from_outside = true;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V const &> persistent_kvfifo<K, V>::front() const {
+    check_not_empty();
+    kv_element const &element = *fifo.min()->value;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> persistent_kvfifo<K, V>::back() {
+    check_not_empty();
+    kv_element &element = unshare_element(fifo.max()->key);
+    modifiable_from_outside = true;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V const &> persistent_kvfifo<K, V>::back() const {
+    check_not_empty();
+    kv_element const &element = *fifo.max()->value;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> persistent_kvfifo<K, V>::first(K const &key) {
+    key_node const *entry = find_key(key);
+    kv_element &element = unshare_element(entry->value.seqs.min()->key);
+    modifiable_from_outside = true;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V const &>
+persistent_kvfifo<K, V>::first(K const &key) const {
+    key_node const *entry = find_key(key);
+    kv_element const &element =
+            *fifo.find(entry->value.seqs.min()->key)->value;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V &> persistent_kvfifo<K, V>::last(K const &key) {
+    key_node const *entry = find_key(key);
+    kv_element &element = unshare_element(entry->value.seqs.max()->key);
+    modifiable_from_outside = true;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+std::pair<K const &, V const &>
+persistent_kvfifo<K, V>::last(K const &key) const {
+    key_node const *entry = find_key(key);
+    kv_element const &element =
+            *fifo.find(entry->value.seqs.max()->key)->value;
+    return {*element.key, element.value};
+}
+
+template <typename K, typename V>
+template <typename F>
+decltype(auto) persistent_kvfifo<K, V>::modify_front(F &&fn) {
+    check_not_empty();
+    kv_element &element = unshare_element(fifo.min()->key);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), element.value);
+}
+
+template <typename K, typename V>
+template <typename F>
+decltype(auto) persistent_kvfifo<K, V>::modify_back(F &&fn) {
+    check_not_empty();
+    kv_element &element = unshare_element(fifo.max()->key);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), element.value);
+}
+
+template <typename K, typename V>
+template <typename F>
+decltype(auto) persistent_kvfifo<K, V>::modify_first(K const &key, F &&fn) {
+    key_node const *entry = find_key(key);
+    kv_element &element = unshare_element(entry->value.seqs.min()->key);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), element.value);
+}
+
+template <typename K, typename V>
+template <typename F>
+decltype(auto) persistent_kvfifo<K, V>::modify_last(K const &key, F &&fn) {
+    key_node const *entry = find_key(key);
+    kv_element &element = unshare_element(entry->value.seqs.max()->key);
+    modifiable_from_outside = false;
+    return std::invoke(std::forward<F>(fn), element.value);
+}
+
+template <typename K, typename V>
+size_t persistent_kvfifo<K, V>::size() const noexcept {
+    return elements;
+}
+
+template <typename K, typename V>
+size_t persistent_kvfifo<K, V>::count(K const &k) const {
+    key_node const *entry = keys.find(k);
+    return entry == nullptr ? 0 : entry->value.count;
+}
+
+template <typename K, typename V>
+bool persistent_kvfifo<K, V>::empty() const noexcept {
+    return elements == 0;
+}
+
+template <typename K, typename V>
+void persistent_kvfifo<K, V>::clear() noexcept {
+    persistent_kvfifo().swap(*this);
+}
+
+template <typename K, typename V>
+typename persistent_kvfifo<K, V>::k_iterator
+persistent_kvfifo<K, V>::k_begin() const noexcept {
+    return k_iterator(keys.root_node(), keys.min());
+}
+
+template <typename K, typename V>
+typename persistent_kvfifo<K, V>::k_iterator
+persistent_kvfifo<K, V>::k_end() const noexcept {
+    return k_iterator(keys.root_node(), nullptr);
+}
+
+#endif  // __PERSISTENT_KVFIFO_H__
@@ -0,0 +1,219 @@
+#include "persistent_kvfifo.h"
+#include "kvfifo.h"
+#include <cassert>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using pq = persistent_kvfifo<int, int>;
+
+// Counts its copies, to check which pushes copy the value.
+struct counted_value {
+    static inline int copies = 0;
+
+    int a;
+
+    counted_value(int a) : a(a) {}
+    counted_value(counted_value const &other) : a(other.a) {
+        ++copies;
+    }
+    counted_value(counted_value &&other) noexcept : a(other.a) {}
+};
+
+// Checks that the queues hold the same elements in the same order, and have
+// the same keys with the same first and last elements.
+void assert_same(pq q, kvfifo<int, int> model) {
+    assert(q.size() == model.size() && q.empty() == model.empty());
+    pq const &cq = q;
+    kvfifo<int, int> const &cmodel = model;
+    auto k_it = q.k_begin();
+    for (auto m_it = model.k_begin(); m_it != model.k_end(); ++m_it, ++k_it) {
+        assert(k_it != q.k_end() && *k_it == *m_it);
+        assert(q.count(*k_it) == model.count(*m_it));
+        assert(cq.first(*k_it).second == cmodel.first(*m_it).second);
+        assert(cq.last(*k_it).second == cmodel.last(*m_it).second);
+    }
+    assert(k_it == q.k_end());
+    while (!model.empty()) {
+        assert(q.front().first == model.front().first);
+        assert(q.front().second == model.front().second);
+        q.pop();
+        model.pop();
+    }
+    assert(q.empty());
+}
+
+int main() {
+    static_assert(std::bidirectional_iterator<pq::k_iterator>);
+
+    int keys[] = {3, 1, 2};
+    pq q1;
+    for (int i = 0; i < 3; ++i)
+        q1.push(keys[i], i);
+
+    auto &ref = q1.front().second;
+    pq q2(q1);
+    pq q3;
+    q3 = q2;
+    ref = 10;
+    assert(q1.front().second == 10);
+    assert(q2.front().second != 10 && q3.front().second != 10);
+
+    q2.pop();
+    assert(q2.size() == 2 && q2.count(3) == 0 && q2.count(2) == 1);
+    assert(q3.size() == 3 && q3.count(3) == 1);
+
+    q2.push(1, 3);
+    q2.move_to_back(1);
+    assert(q2.size() == 3);
+    assert(q2.front().second == 2 &&
+           q2.first(1).second == 1 &&
+           q2.last(1).second == 3 &&
+           q2.back().second == 3);
+
+    pq const q4 = q2;
+    assert(q4.front().second == 2 &&
+           q4.first(1).second == 1 &&
+           q4.last(1).second == 3 &&
+           q4.back().second == 3);
+
+    int i = 1;
+    for (auto k_it = q1.k_begin(); k_it != q1.k_end(); ++k_it, ++i)
+        assert(i <= 3 && *k_it == i);
+    auto k_last = q1.k_end();
+    assert(*--k_last == 3 && *--k_last == 2);
+
+    try {
+        pq().pop();
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+    try {
+        q1.first(7);
+        assert(false);
+    } catch (std::invalid_argument const &) {}
+
+    // Modifying a copy leaves the original alone, whichever of them is
+    // modified and however the value is reached.
+    pq base;
+    for (int j = 0; j < 1000; ++j)
+        base.push(j % 10, j);
+    pq fork = base;
+    fork.last(5).second = -1;
+    fork.pop(5);
+    fork.move_to_back(0);
+    assert(base.last(5).second == 995 && base.first(5).second == 5);
+    assert(base.front().second == 0 && fork.front().second == 1);
+    assert(fork.last(5).second == -1 && fork.back().second == 990);
+
+    // modify_* leave nothing behind that later copies would have to copy.
+    pq modified = base;
+    modified.modify_front([](int &v) { v = -2; });
+    assert(modified.modify_first(5, [](int &v) { return v; }) == 5);
+    pq modified_copy = modified;
+    modified_copy.modify_back([](int &v) { ++v; });
+    modified_copy.modify_last(8, [](int &v) { v = -8; });
+    assert(base.front().second == 0 && modified.front().second == -2);
+    assert(modified.back().second == 999 && modified_copy.back().second == 1000);
+    assert(modified.last(8).second == 998 && modified_copy.last(8).second == -8);
+
+    // Keys are stored once, and values built in place.
+    persistent_kvfifo<std::string, std::string> strings;
+    strings.push("key", "a");
+    strings.emplace("key", 3, 'b');
+    assert(strings.count("key") == 2 && strings.back().second == "bbb");
+    strings.clear();
+    assert(strings.empty() && strings.k_begin() == strings.k_end());
+
+    // A value passed by rvalue is moved in, whatever the key is passed by.
+    persistent_kvfifo<int, counted_value> pushed;
+    int pushed_key = 1;
+    counted_value pushed_value(1);
+    pushed.push(pushed_key, counted_value(2));
+    pushed.push(pushed_key, std::move(pushed_value));
+    assert(counted_value::copies == 0);
+    pushed.push(2, pushed_value);
+    assert(counted_value::copies == 1);
+    assert(pushed.size() == 3 && pushed.count(1) == 2);
+
+    // Random operations on a few versions, checked against kvfifo.
+    std::mt19937 gen(1);
+    std::vector<pq> versions(4);
+    std::vector<kvfifo<int, int>> models(4);
+    for (int step = 0; step < 20000; ++step) {
+        size_t v = gen() % versions.size();
+        int k = int(gen() % 8);
+        switch (gen() % 8) {
+            case 0:
+            case 1:
+            case 2:
+                versions[v].push(k, step);
+                models[v].push(k, step);
+                break;
+            case 3:
+                if (!models[v].empty()) {
+                    versions[v].pop();
+                    models[v].pop();
+                }
+                break;
+            case 4:
+                if (models[v].count(k) > 0) {
+                    versions[v].pop(k);
+                    models[v].pop(k);
+                }
+                break;
+            case 5:
+                if (models[v].count(k) > 0) {
+                    versions[v].move_to_back(k);
+                    models[v].move_to_back(k);
+                }
+                break;
+            case 6:
+                if (models[v].count(k) > 0) {
+                    versions[v].first(k).second = -step;
+                    models[v].first(k).second = -step;
+                }
+                break;
+            case 7: {
+                size_t w = gen() % versions.size();
+                versions[w] = versions[v];
+                models[w] = models[v];
+                break;
+            }
+        }
+        if (step % 1000 == 0) {
+            assert_same(versions[v], models[v]);
+        }
+    }
+    for (size_t v = 0; v < versions.size(); ++v)
+        assert_same(versions[v], models[v]);
+
+    // Copies read in other threads and dropped there leave the nodes and
+    // values to the queue, which then modifies them in place.
+    pq shared;
+    for (int j = 0; j < 100; ++j) {
+        shared.push(j % 10, j);
+    }
+    for (int round = 0; round < 50; ++round) {
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 2; ++t) {
+            readers.emplace_back([copy = shared, round]() mutable {
+                assert(copy.size() == 100 && copy.front().second == round);
+                for (int k = 0; k < 10; ++k) {
+                    assert(copy.count(k) == 10);
+                }
+                copy = {};
+            });
+        }
+        for (int j = 0; j < 100; ++j) {
+            shared.pop();
+            shared.push(j % 10, j);
+            shared.first(j % 10).second = j;
+        }
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        shared.front().second = round + 1;
+    }
+}
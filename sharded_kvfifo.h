@@ -0,0 +1,315 @@
+#ifndef __SHARDED_KVFIFO_H__
+#define __SHARDED_KVFIFO_H__
+
+#include "kvfifo.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+// A kvfifo that many threads may use at the same time, split into N kvfifo
+// shards by the hash of the key. Each shard has a mutex of its own, and a
+// keyed operation locks only the shard of its key. K needs std::hash<K> as
+// well as what kvfifo needs.
+//
+// Every element is stamped with a number from a counter shared by all shards,
+// taken under the lock of its shard, so the stamps grow from front to back in
+// each shard. pop and front take the front of the shard with the smallest
+// stamp, which is the oldest element of the whole queue. move_to_back(k)
+// does not restamp the elements it moves: it records a stamp for the key, and
+// the elements of the key pushed before it count as having that stamp.
+//
+// Each shard publishes the stamp of its front, so pop and front find the
+// oldest shard without taking any lock and then lock only that shard. If its
+// front changed in the meantime, they look again.
+//
+// Since another thread may pop an element at any time, front, first and last
+// return copies, and pop returns the element it removed. If an operation
+// throws, the queue is unchanged.
+template <typename K, typename V, size_t N = 16>
+class sharded_kvfifo {
+    static_assert(N > 0, "sharded_kvfifo needs at least one shard");
+
+private:
+    struct kv_stamped {
+        uint64_t stamp;
+        V value;
+
+        template <typename... Args>
+        explicit kv_stamped(uint64_t s, Args &&...args)
+            : stamp(s),
+              value(std::forward<Args>(args)...) {}
+    };
+
+    static constexpr uint64_t no_stamp = std::numeric_limits<uint64_t>::max();
+
+    struct alignas(64) kv_shard {
+        std::mutex lock;
+        kvfifo<K, kv_stamped> queue;
+        // Stamp of the last move_to_back, for the keys in the shard that were
+        // moved.
+        std::unordered_map<K, uint64_t> moved;
+        // Stamp of the front element, or no_stamp if the shard is empty.
+        // Written with the shard locked.
+        std::atomic<uint64_t> front_stamp{no_stamp};
+    };
+
+    std::array<kv_shard, N> shards;
+    alignas(64) std::atomic<uint64_t> next_stamp;
+    std::atomic<size_t> elements;
+
+    kv_shard &shard(K const &k);
+    kv_shard &oldest_shard(std::unique_lock<std::mutex> &shard_lock);
+    uint64_t stamp_of(kv_shard &s, K const &k, kv_stamped const &element);
+    void update_front(kv_shard &s);
+    void forget_if_gone(kv_shard &s, K const &k);
+
+    template <typename Key, typename... Args>
+    void emplace_key(Key &&k, Args &&...args);
+
+public:
+    sharded_kvfifo();
+    sharded_kvfifo(sharded_kvfifo const &) = delete;
+    sharded_kvfifo& operator=(sharded_kvfifo const &) = delete;
+
+    void push(K const &k, V const &v);
+    void push(K const &k, V &&v);
+    void push(K &&k, V const &v);
+    void push(K &&k, V &&v);
+
+    template <typename... Args>
+    void emplace(K const &k, Args &&...args);
+    template <typename... Args>
+    void emplace(K &&k, Args &&...args);
+
+    std::pair<K, V> pop();
+    std::pair<K, V> pop(K const &k);
+
+    void move_to_back(K const &k);
+
+    std::pair<K, V> front();
+    std::pair<K, V> first(K const &key);
+    std::pair<K, V> last(K const &key);
+
+    size_t size() const noexcept;
+    size_t count(K const &k);
+    bool empty() const noexcept;
+};
+
+template <typename K, typename V, size_t N>
+sharded_kvfifo<K, V, N>::sharded_kvfifo()
+    : next_stamp(0),
+      elements(0) {}
+
+template <typename K, typename V, size_t N>
+typename sharded_kvfifo<K, V, N>::kv_shard &
+sharded_kvfifo<K, V, N>::shard(K const &k) {
+    return shards[std::hash<K>()(k) % N];
+}
+
+// Called with the shard locked.
+template <typename K, typename V, size_t N>
+uint64_t sharded_kvfifo<K, V, N>::stamp_of(kv_shard &s, K const &k,
+                                           kv_stamped const &element) {
+    if (s.moved.empty()) {
+        return element.stamp;
+    }
+    auto it = s.moved.find(k);
+    return it == s.moved.end() ? element.stamp
+                               : std::max(element.stamp, it->second);
+}
+
+// Called with the shard locked, after its front may have changed.
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::update_front(kv_shard &s) {
+    uint64_t stamp = no_stamp;
+    if (!s.queue.empty()) {
+        auto element = std::as_const(s.queue).front();
+        stamp = stamp_of(s, element.first, element.second);
+    }
+    s.front_stamp.store(stamp, std::memory_order_relaxed);
+}
+
+// Called with the shard locked, after an element of the key was popped.
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::forget_if_gone(kv_shard &s, K const &k) {
+    if (!s.moved.empty() && s.queue.count(k) == 0) {
+        s.moved.erase(k);
+    }
+}
+
+// Returns the shard with the oldest element, locked in shard_lock, or throws
+// if every shard is empty. The stamps of the fronts only grow, so a shard that
+// held nothing older when it was looked at cannot later hold something older
+// than the shard chosen, except for elements pushed during the call.
+template <typename K, typename V, size_t N>
+typename sharded_kvfifo<K, V, N>::kv_shard &
+sharded_kvfifo<K, V, N>::oldest_shard(
+        std::unique_lock<std::mutex> &shard_lock) {
+    while (true) {
+        kv_shard *oldest = nullptr;
+        uint64_t oldest_stamp = no_stamp;
+        for (auto &s : shards) {
+            uint64_t stamp = s.front_stamp.load(std::memory_order_relaxed);
+            if (stamp < oldest_stamp) {
+                oldest = &s;
+                oldest_stamp = stamp;
+            }
+        }
+        if (oldest == nullptr) {
+            throw std::invalid_argument("Queue is empty!");
+        }
+        shard_lock = std::unique_lock<std::mutex>(oldest->lock);
+        if (oldest->front_stamp.load(std::memory_order_relaxed)
+            == oldest_stamp) {
+            return *oldest;
+        }
+        shard_lock.unlock();
+    }
+}
+
+template <typename K, typename V, size_t N>
+template <typename Key, typename... Args>
+void sharded_kvfifo<K, V, N>::emplace_key(Key &&k, Args &&...args) {
+    kv_shard &s = shard(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    uint64_t stamp = next_stamp.fetch_add(1, std::memory_order_relaxed);
+    s.queue.emplace(std::forward<Key>(k), stamp, std::forward<Args>(args)...);
+    elements.fetch_add(1, std::memory_order_relaxed);
+    if (s.queue.size() == 1) {
+        s.front_stamp.store(stamp, std::memory_order_relaxed);
+    }
+}
+
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::push(K const &k, V const &v) {
+    emplace_key(k, v);
+}
+
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::push(K const &k, V &&v) {
+    emplace_key(k, std::move(v));
+}
+
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::push(K &&k, V const &v) {
+    emplace_key(std::move(k), v);
+}
+
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::push(K &&k, V &&v) {
+    emplace_key(std::move(k), std::move(v));
+}
+
+template <typename K, typename V, size_t N>
+template <typename... Args>
+void sharded_kvfifo<K, V, N>::emplace(K const &k, Args &&...args) {
+    emplace_key(k, std::forward<Args>(args)...);
+}
+
+template <typename K, typename V, size_t N>
+template <typename... Args>
+void sharded_kvfifo<K, V, N>::emplace(K &&k, Args &&...args) {
+    emplace_key(std::move(k), std::forward<Args>(args)...);
+}
+
+// The key is copied before the value is moved out, so if copying it throws
+// the element is still whole.
+template <typename K, typename V, size_t N>
+std::pair<K, V> sharded_kvfifo<K, V, N>::pop() {
+    std::unique_lock<std::mutex> shard_lock;
+    kv_shard &s = oldest_shard(shard_lock);
+    auto front = s.queue.front();
+    std::pair<K, V> element(front.first, std::move(front.second.value));
+    s.queue.pop();
+    elements.fetch_sub(1, std::memory_order_relaxed);
+    forget_if_gone(s, element.first);
+    update_front(s);
+    return element;
+}
+
+template <typename K, typename V, size_t N>
+std::pair<K, V> sharded_kvfifo<K, V, N>::pop(K const &k) {
+    kv_shard &s = shard(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto first = s.queue.first(k);
+    std::pair<K, V> element(first.first, std::move(first.second.value));
+    s.queue.pop(k);
+    elements.fetch_sub(1, std::memory_order_relaxed);
+    forget_if_gone(s, k);
+    update_front(s);
+    return element;
+}
+
+// kvfifo::move_to_back gives the strong guarantee, so the stamp of the key is
+// made room for before and set after it.
+template <typename K, typename V, size_t N>
+void sharded_kvfifo<K, V, N>::move_to_back(K const &k) {
+    kv_shard &s = shard(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (s.queue.count(k) == 0) {
+        throw std::invalid_argument("No such key in the queue!");
+    }
+    auto [it, inserted] = s.moved.try_emplace(k, 0);
+    try {
+        s.queue.move_to_back(k);
+    } catch (...) {
+        if (inserted) {
+            s.moved.erase(it);
+        }
+        throw;
+    }
+    it->second = next_stamp.fetch_add(1, std::memory_order_relaxed);
+    update_front(s);
+}
+
+template <typename K, typename V, size_t N>
+std::pair<K, V> sharded_kvfifo<K, V, N>::front() {
+    std::unique_lock<std::mutex> shard_lock;
+    kv_shard &s = oldest_shard(shard_lock);
+    auto front = std::as_const(s.queue).front();
+    return {front.first, front.second.value};
+}
+
+template <typename K, typename V, size_t N>
+std::pair<K, V> sharded_kvfifo<K, V, N>::first(K const &key) {
+    kv_shard &s = shard(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto first = std::as_const(s.queue).first(key);
+    return {first.first, first.second.value};
+}
+
+template <typename K, typename V, size_t N>
+std::pair<K, V> sharded_kvfifo<K, V, N>::last(K const &key) {
+    kv_shard &s = shard(key);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto last = std::as_const(s.queue).last(key);
+    return {last.first, last.second.value};
+}
+
+template <typename K, typename V, size_t N>
+size_t sharded_kvfifo<K, V, N>::size() const noexcept {
+    return elements.load(std::memory_order_relaxed);
+}
+
+template <typename K, typename V, size_t N>
+size_t sharded_kvfifo<K, V, N>::count(K const &k) {
+    kv_shard &s = shard(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    return s.queue.count(k);
+}
+
+template <typename K, typename V, size_t N>
+bool sharded_kvfifo<K, V, N>::empty() const noexcept {
+    return size() == 0;
+}
+
+#endif  // __SHARDED_KVFIFO_H__
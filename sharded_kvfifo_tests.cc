@@ -0,0 +1,144 @@
+#include "sharded_kvfifo.h"
+#include "concurrent_kvfifo_checks.h"
+#include "kvfifo.h"
+#include <atomic>
+#include <cassert>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// With int keys, std::hash is the identity in libstdc++: key k goes to shard
+// k % 4, which the tests below use to put keys side by side in one shard or
+// apart in different ones.
+using sq = sharded_kvfifo<int, int, 4>;
+
+// Pops everything, checking that the values come in the given order.
+void assert_order(sq &q, std::vector<int> const &values) {
+    assert(q.size() == values.size());
+    for (int v : values) {
+        assert(q.front().second == v);
+        assert(q.pop().second == v);
+    }
+    assert(q.empty());
+}
+
+int main() {
+    check_basics<sq>();
+
+    sharded_kvfifo<std::string, std::string> qs;
+    qs.emplace("a", 3, 'x');
+    qs.push(std::string("b"), std::string("y"));
+    assert(qs.front().second == "xxx" && qs.last("b").second == "y");
+
+    check_against_model<sq>(0);
+
+    // The elements a key had when it was moved count as pushed by the move,
+    // in the order of the whole queue, while the later pushes of the key
+    // keep their own place. Keys 0 and 4 share shard 0, 1 and 5 shard 1.
+    sq q1;
+    q1.push(0, 0);
+    q1.push(1, 1);
+    q1.push(4, 2);
+    q1.push(2, 3);
+    q1.move_to_back(0);
+    q1.push(5, 4);
+    q1.push(0, 5);
+    assert(q1.last(0).second == 5 && q1.first(0).second == 0);
+    assert_order(q1, {1, 2, 3, 0, 4, 5});
+
+    // Moves of keys in different shards are ordered among themselves, and
+    // a moved key that came back to the front of its shard does not hide
+    // the older front of another shard.
+    q1.push(0, 0);
+    q1.push(1, 1);
+    q1.push(2, 2);
+    q1.push(3, 3);
+    q1.move_to_back(2);
+    q1.move_to_back(0);
+    q1.move_to_back(1);
+    assert(q1.front().second == 3 && q1.count(0) == 1);
+    q1.push(4, 4);
+    q1.move_to_back(0);
+    q1.push(3, 5);
+    assert_order(q1, {3, 2, 1, 4, 0, 5});
+
+    // Popping the moved front of a shard by key passes the front on to the
+    // elements pushed after it, in whichever shard they are.
+    q1.push(8, 0);
+    q1.push(1, 1);
+    q1.move_to_back(8);
+    assert(q1.pop(8).second == 0 && q1.count(8) == 0);
+    q1.push(9, 2);
+    q1.push(8, 3);
+    q1.push(5, 4);
+    assert_order(q1, {1, 2, 3, 4});
+
+    // Threads push, move and pop by key at the same time, each its own keys
+    // spread over all the shards. Whatever the interleaving, the elements of
+    // each thread come out in the order its own operations give on a
+    // kvfifo, while a reader keeps looking at the front.
+    int const movers = 4, operations = 20000;
+    sq q2;
+    std::vector<kvfifo<int, int>> models(movers);
+    std::atomic<bool> moving = true;
+    std::thread reader([&q2, &moving] {
+        while (moving.load()) {
+            try {
+                auto [k, v] = q2.front();
+                assert(k >= 0 && k < 4 * movers && v >= 0);
+            } catch (std::invalid_argument const &) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int t = 0; t < movers; ++t) {
+        threads.emplace_back([&q2, &models, t] {
+            std::mt19937 rng(t);
+            kvfifo<int, int> &model = models[t];
+            for (int i = 0; i < operations; ++i) {
+                int k = 4 * t + int(rng() % 4);
+                switch (rng() % 4) {
+                    case 0:
+                    case 1:
+                        q2.push(k, i);
+                        model.push(k, i);
+                        break;
+                    case 2:
+                        if (model.count(k) > 0) {
+                            assert(q2.pop(k).second == model.first(k).second);
+                            model.pop(k);
+                        }
+                        break;
+                    default:
+                        if (model.count(k) > 0) {
+                            q2.move_to_back(k);
+                            model.move_to_back(k);
+                        }
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    moving = false;
+    reader.join();
+    size_t left = 0;
+    for (auto const &model : models) {
+        left += model.size();
+    }
+    assert(q2.size() == left);
+    while (!q2.empty()) {
+        auto [k, v] = q2.pop();
+        kvfifo<int, int> &model = models[k / 4];
+        assert(model.front().first == k && model.front().second == v);
+        model.pop();
+    }
+    for (auto const &model : models) {
+        assert(model.empty());
+    }
+
+    check_producers_consumers<sq>();
+}
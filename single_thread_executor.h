@@ -0,0 +1,76 @@
+#ifndef __SINGLE_THREAD_EXECUTOR_H__
+#define __SINGLE_THREAD_EXECUTOR_H__
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Resumes the coroutines posted to it, from any thread, on the one thread
+// that calls run. It is the executor concurrent_kvfifo::async_pop expects:
+// anything with a noexcept post(std::coroutine_handle<>) that may be called
+// from any thread will do. Running out of memory in post terminates.
+class single_thread_executor {
+private:
+    std::mutex lock;
+    std::condition_variable posted;
+    std::deque<std::coroutine_handle<>> ready;
+    bool stopped = false;
+
+public:
+    void post(std::coroutine_handle<> handle) noexcept;
+
+    // Resumes posted coroutines, sleeping while there are none, until stop
+    // has been called and none are left.
+    void run();
+    // Resumes the coroutines posted so far and returns how many there were.
+    size_t run_ready();
+    void stop();
+};
+
+inline void single_thread_executor::post(
+        std::coroutine_handle<> handle) noexcept {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready.push_back(handle);
+    }
+    posted.notify_one();
+}
+
+inline void single_thread_executor::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        posted.wait(guard, [this] { return stopped || !ready.empty(); });
+        if (ready.empty()) {
+            return;
+        }
+        auto handle = ready.front();
+        ready.pop_front();
+        guard.unlock();
+        handle.resume();
+        guard.lock();
+    }
+}
+
+inline size_t single_thread_executor::run_ready() {
+    std::deque<std::coroutine_handle<>> resumed;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        resumed.swap(ready);
+    }
+    for (auto handle : resumed) {
+        handle.resume();
+    }
+    return resumed.size();
+}
+
+inline void single_thread_executor::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopped = true;
+    }
+    posted.notify_all();
+}
+
+#endif  // __SINGLE_THREAD_EXECUTOR_H__